@@ -0,0 +1,103 @@
+#include "unity.h"
+#include "repo.h"
+#include "repo_backend.h"
+#include "picofeed.h"
+#include "test_util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define IMAGE "host_test_PiC0.img"
+#define INGEST_BLOCKS 640 /* halves divisible by INGEST_BATCH */
+#define INGEST_BATCH 8
+
+TEST_CASE("posix backend behaves like NOR-flash", "[backend]") {
+  unlink(IMAGE);
+  pr_backend_posix_config(&(pr_posix_config_t){ .path = IMAGE });
+  pr_geometry_t geometry = {0};
+  TEST_ASSERT_EQUAL(0, pr_backend_posix.open(&geometry));
+  TEST_ASSERT_EQUAL(4096, geometry.erase_size);
+  TEST_ASSERT_NOT_NULL(geometry.mapped);
+  TEST_ASSERT_EQUAL_HEX8(0xff, geometry.mapped[geometry.size - 1]);
+
+  uint8_t b = 0xf0, out = 0;
+  TEST_ASSERT_EQUAL(ESP_OK, pr_backend_posix.write(4096, &b, 1));
+  b = 0x3c; /* can only pull bits down */
+  TEST_ASSERT_EQUAL(ESP_OK, pr_backend_posix.write(4096, &b, 1));
+  TEST_ASSERT_EQUAL(ESP_OK, pr_backend_posix.read(4096, &out, 1));
+  TEST_ASSERT_EQUAL_HEX8(0x30, out);
+
+  TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, pr_backend_posix.erase(4097, 4096));
+  TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE, pr_backend_posix.erase(geometry.size, 4096));
+  TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE, pr_backend_posix.write(geometry.size - 1, &b, 2));
+  TEST_ASSERT_EQUAL(ESP_OK, pr_backend_posix.erase(4096, 4096));
+  TEST_ASSERT_EQUAL_HEX8(0xff, geometry.mapped[4096]);
+  pr_backend_posix.close();
+
+  /* Reopening keeps content */
+  TEST_ASSERT_EQUAL(ESP_OK, pr_backend_posix.open(&geometry));
+  TEST_ASSERT_EQUAL(ESP_OK, pr_backend_posix.write(0, &b, 1));
+  pr_backend_posix.close();
+  TEST_ASSERT_EQUAL(ESP_OK, pr_backend_posix.open(&geometry));
+  TEST_ASSERT_EQUAL_HEX8(0x3c, geometry.mapped[0]);
+  pr_backend_posix.close();
+  unlink(IMAGE);
+}
+
+TEST_CASE("posix backend refuses image of wrong size", "[backend]") {
+  int fd = open(IMAGE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  TEST_ASSERT_GREATER_OR_EQUAL(0, fd);
+  TEST_ASSERT_EQUAL(5, write(fd, "hello", 5));
+  close(fd);
+  pr_backend_posix_config(&(pr_posix_config_t){ .path = IMAGE });
+  pr_geometry_t geometry = {0};
+  TEST_ASSERT_EQUAL(-1, pr_backend_posix.open(&geometry));
+  struct stat st;
+  TEST_ASSERT_EQUAL(0, stat(IMAGE, &st));
+  TEST_ASSERT_EQUAL(5, st.st_size); /* left untouched */
+  unlink(IMAGE);
+}
+
+/* Latencies come from env PR_HOST_WRITE_US / PR_HOST_ERASE_US */
+TEST_CASE("ingest throughput", "[backend][perf]") {
+  unlink(IMAGE);
+  pr_backend_posix_config(&(pr_posix_config_t){ .path = IMAGE });
+  TEST_ASSERT_EQUAL(0, pr_init());
+  pico_keypair_t pair = {0};
+  pico_crypto_keypair(&pair);
+  static uint8_t *blocks[INGEST_BLOCKS];
+  size_t bytes = 0;
+  for (int i = 0; i < INGEST_BLOCKS; i++) {
+    blocks[i] = make_block(pair, i, 16 + (i * 37) % 900);
+    bytes += pf_sizeof((const pf_block_t*)blocks[i]);
+  }
+
+  double t0 = now_s();
+  for (int i = 0; i < INGEST_BLOCKS / 2; i++) {
+    TEST_ASSERT_GREATER_OR_EQUAL(0, pr_write_block(blocks[i], 1));
+  }
+  double t1 = now_s();
+  pr_write_req_t reqs[INGEST_BATCH] = {0};
+  for (int i = INGEST_BLOCKS / 2; i < INGEST_BLOCKS; i += INGEST_BATCH) {
+    for (int r = 0; r < INGEST_BATCH; r++) reqs[r] = (pr_write_req_t){ .block_bytes = blocks[i + r], .hops = 1 };
+    TEST_ASSERT_EQUAL(INGEST_BATCH, pr_write_blocks(reqs, INGEST_BATCH));
+  }
+  double t2 = now_s();
+  printf("ingest single: %.0f blocks/s, batched(%i): %.0f blocks/s, %.1f KiB total\n",
+    INGEST_BLOCKS / 2 / (t1 - t0), INGEST_BATCH, INGEST_BLOCKS / 2 / (t2 - t1), bytes / 1024.0);
+
+  /* Everything written is found again after remount */
+  pr_deinit();
+  TEST_ASSERT_EQUAL(0, pr_init());
+  int found = 0;
+  pr_iterator_t iter = { .mode = PR_ITER_HEADERS };
+  while (!pr_iter_next(&iter)) found++;
+  pr_iter_deinit(&iter);
+  TEST_ASSERT_EQUAL(INGEST_BLOCKS, found);
+  pr_deinit();
+  for (int i = 0; i < INGEST_BLOCKS; i++) free(blocks[i]);
+  unlink(IMAGE);
+}
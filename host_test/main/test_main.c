@@ -0,0 +1,8 @@
+#include "unity.h"
+#include <stdlib.h>
+
+void app_main(void) {
+  UNITY_BEGIN();
+  unity_run_all_tests();
+  exit(UNITY_END());
+}
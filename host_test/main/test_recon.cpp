@@ -0,0 +1,416 @@
+/* White box, wire format & session state are private to recon_sync.cpp */
+#include "../../main/recon_sync.cpp"
+#include "negentropy/storage/Vector.h"
+#include "unity.h"
+#include "repo_backend.h"
+#include "monocypher.h"
+#include "test_util.h"
+#include <deque>
+#include <map>
+#include <unistd.h>
+
+#define IMAGE "host_test_PiC0.img"
+#define OWN_BLOCKS 60 /* only in our repo, outlasts what the peer gives */
+#define SHARED_BLOCKS 5
+#define PEER_BLOCKS 40 /* only with the peer, two frames of wants */
+
+extern "C" void bump_time(uint64_t utc_millis) {}
+
+typedef std::deque<std::string> frames_t;
+
+/**
+ * Scripted non-initiator with its own blocks, speaks either
+ * T_BATCH or the baseline exchange of one block per round trip.
+ */
+struct peer {
+  int baseline; /* ignores T_HELLO, drops the connection on T_BATCH */
+  int window; /* answered to a hello */
+  int offered; /* window in the initiator's hello, -1 when none came */
+  negentropy::storage::Vector items;
+  std::map<std::string, std::string> blocks; /* hash -> block */
+  std::vector<std::string> received; /* hashes of blocks given to peer */
+  std::deque<std::string> wanted; /* queued, given over the next batches */
+  int unacked; /* initiator batches since our last */
+  int n_batches, n_pure_acks, n_exchanges;
+  int dropped; /* connection dropped like a baseline peer would */
+};
+
+/* What crossed the wire from the initiator */
+struct trace {
+  int outstanding; /* batches that cost a credit, not yet acked */
+  int max_outstanding;
+  int max_frame;
+};
+
+static std::string hash_of(const uint8_t *block) {
+  uint8_t hash[32];
+  crypto_blake2b(hash, sizeof(hash), block, pf_sizeof((const pf_block_t*)block));
+  return std::string((const char*)hash, sizeof(hash));
+}
+
+static void peer_add(struct peer &p, const uint8_t *block) {
+  const std::string hash = hash_of(block);
+  p.blocks[hash] = std::string((const char*)block, pf_sizeof((const pf_block_t*)block));
+  p.items.insert(pf_read_utc(((const pf_block_t*)block)->net.date), hash);
+}
+
+static void peer_store(struct peer &p, const uint8_t *block, size_t size) {
+  TEST_ASSERT_EQUAL(pf_sizeof((const pf_block_t*)block), size);
+  p.received.push_back(hash_of(block));
+}
+
+/* Baseline exchange, gives one block per want */
+static std::string peer_exchange(struct peer &p, const std::string &in) {
+  const struct exchange_packet *x = (const struct exchange_packet*) in.data();
+  TEST_ASSERT_GREATER_OR_EQUAL(sizeof(struct exchange_packet), in.size());
+  if (x->type & T_GIVE_SET) peer_store(p, x->block_bytes, in.size() - sizeof(struct exchange_packet));
+  std::string out(sizeof(struct exchange_packet), '\0');
+  struct exchange_packet *r = (struct exchange_packet*) out.data();
+  r->type = T_EXCHANGE;
+  if (x->type & T_WANT_SET) {
+    auto it = p.blocks.find(std::string((const char*)x->want, ID_SIZE));
+    TEST_ASSERT_TRUE(it != p.blocks.end());
+    out.append(it->second);
+    r = (struct exchange_packet*) out.data();
+    r->type |= T_GIVE_SET;
+    r->offer_hops = 1;
+  }
+  p.n_exchanges++;
+  return out;
+}
+
+/* Answers every batch that cost a credit, pure acks when nothing is queued */
+static int peer_batch(struct peer &p, const std::string &in, frames_t &out) {
+  const struct batch_header *b = (const struct batch_header*) in.data();
+  const uint8_t *ptr = b->wants;
+  for (int i = 0; i < b->n_wants; i++, ptr += ID_SIZE) p.wanted.emplace_back((const char*)ptr, ID_SIZE);
+  TEST_ASSERT_LESS_OR_EQUAL(BACKLOG_MAX, p.wanted.size());
+  for (int i = 0; i < b->n_gives; i++) {
+    const struct batch_give *g = (const struct batch_give*) ptr;
+    peer_store(p, g->block_bytes, g->size);
+    ptr = g->block_bytes + g->size;
+  }
+  TEST_ASSERT_EQUAL(in.size(), ptr - (const uint8_t*)in.data());
+  p.n_batches++;
+  if (b->n_wants || b->n_gives) p.unacked++;
+  if (!p.unacked && p.wanted.empty()) return 0; /* pure acks are never acked */
+
+  std::string frame(sizeof(struct batch_header), '\0');
+  int n_gives = 0;
+  while (!p.wanted.empty()) {
+    const std::string &block = p.blocks.at(p.wanted.front());
+    if (frame.size() + sizeof(struct batch_give) + block.size() > MAX_FRAME_SIZE) break;
+    struct batch_give g = { .hops = 1, .size = (uint16_t)block.size() };
+    frame.append((const char*)&g, sizeof(g));
+    frame.append(block);
+    p.wanted.pop_front();
+    n_gives++;
+  }
+  struct batch_header *r = (struct batch_header*) frame.data();
+  r->type = T_BATCH;
+  r->n_gives = n_gives;
+  r->backlog = p.wanted.size();
+  r->ack = p.unacked;
+  p.unacked = 0;
+  p.n_pure_acks += !n_gives;
+  out.push_back(frame);
+  return 0;
+}
+
+/* @return 1 when the peer dropped the connection */
+static int peer_receive(struct peer &p, negentropy::Negentropy<negentropy::storage::Vector> &ne, const std::string &in, frames_t &out) {
+  const uint8_t type = in[0];
+  if (type == T_RECONCILE) {
+    out.push_back(std::string(1, (char)T_RECONCILE) + ne.reconcile(std::string_view(in).substr(1)));
+    return 0;
+  }
+  if (type == T_BATCH) {
+    if (p.baseline) return p.dropped = 1;
+    return peer_batch(p, in, out);
+  }
+  TEST_ASSERT_EQUAL(T_EXCHANGE, type & 0b11);
+  if (type & T_HELLO) {
+    const struct exchange_packet *x = (const struct exchange_packet*) in.data();
+    p.offered = x->want[0];
+    if (!p.baseline) {
+      std::string hello(sizeof(struct exchange_packet), '\0');
+      hello[0] = T_EXCHANGE | T_HELLO;
+      hello[1] = std::min(p.window, p.offered);
+      out.push_back(hello);
+      return 0;
+    }
+  }
+  out.push_back(peer_exchange(p, in));
+  return 0;
+}
+
+static void trace_sent(struct trace &t, const pwire_event_t &ev) {
+  t.max_frame = std::max(t.max_frame, (int)ev.size);
+  const struct batch_header *b = (const struct batch_header*) ev.message;
+  if (ev.message[0] != T_BATCH || !(b->n_wants || b->n_gives)) return;
+  t.outstanding++;
+  t.max_outstanding = std::max(t.max_outstanding, t.outstanding);
+}
+
+static void trace_received(struct trace &t, const std::string &frame) {
+  if (frame[0] == T_BATCH) t.outstanding -= ((const struct batch_header*) frame.data())->ack;
+  TEST_ASSERT_GREATER_OR_EQUAL(0, t.outstanding);
+}
+
+/* Runs the initiator against p over an in-memory transport until it closes */
+static struct trace sync_with(struct peer &p) {
+  struct trace t = {};
+  p.offered = -1;
+  p.items.seal();
+  negentropy::Negentropy<negentropy::storage::Vector> ne(p.items, MAX_FRAME_SIZE);
+  pwire_handlers_t *h = recon_init_io();
+  pwire_event_t ev = { .initiator = 1, .message = NULL, .size = 0, .session = NULL };
+  TEST_ASSERT_EQUAL(PW_REPLY, h->on_open(&ev));
+  void *session = ev.session;
+  frames_t to_peer, to_us;
+  to_peer.emplace_back((const char*)ev.message, ev.size);
+  int closed = 0;
+  for (int steps = 0; !closed && !p.dropped; steps++) {
+    TEST_ASSERT_LESS_THAN(10000, steps);
+    if (!to_peer.empty()) {
+      peer_receive(p, ne, to_peer.front(), to_us);
+      to_peer.pop_front();
+      continue;
+    }
+    TEST_ASSERT_FALSE(to_us.empty()); /* both sides waiting */
+    std::string frame = to_us.front();
+    to_us.pop_front();
+    trace_received(t, frame);
+    ev = { .initiator = 1, .message = (uint8_t*)frame.data(), .size = (uint32_t)frame.size(), .session = session };
+    pwire_ret_t r = h->on_data(&ev);
+    while (r == PW_REPLY || r == PW_REPLY_MORE) {
+      trace_sent(t, ev);
+      TEST_ASSERT_LESS_OR_EQUAL(p.baseline ? 1 : p.window, t.outstanding);
+      to_peer.emplace_back((const char*)ev.message, ev.size);
+      if (r == PW_REPLY) break;
+      ev = { .initiator = 1, .message = NULL, .size = 0, .session = session };
+      r = h->on_data(&ev);
+    }
+    closed = r == PW_CLOSE;
+  }
+  ev = { .initiator = 1, .message = NULL, .size = 0, .session = session };
+  h->on_close(&ev);
+  TEST_ASSERT_LESS_OR_EQUAL(PW_MAX_FRAME_SIZE, t.max_frame);
+  return t;
+}
+
+static uint8_t *blocks[OWN_BLOCKS + SHARED_BLOCKS + PEER_BLOCKS];
+
+/* Fresh repo with own & shared blocks, peer holds shared & its own */
+static void setup(struct peer &p) {
+  unlink(IMAGE);
+  pr_posix_config_t config = { .path = IMAGE };
+  pr_backend_posix_config(&config);
+  TEST_ASSERT_EQUAL(0, pr_init());
+  pico_keypair_t pair = {0};
+  pico_crypto_keypair(&pair);
+  for (int i = 0; i < OWN_BLOCKS + SHARED_BLOCKS + PEER_BLOCKS; i++) {
+    blocks[i] = make_block(pair, i, 100 + (i * 37) % 400);
+    if (i < OWN_BLOCKS + SHARED_BLOCKS) TEST_ASSERT_GREATER_OR_EQUAL(0, pr_write_block(blocks[i], 1));
+    if (i >= OWN_BLOCKS) peer_add(p, blocks[i]);
+  }
+}
+
+static void teardown(void) {
+  for (int i = 0; i < OWN_BLOCKS + SHARED_BLOCKS + PEER_BLOCKS; i++) free(blocks[i]);
+  pr_deinit();
+  unlink(IMAGE);
+}
+
+/* Each side ends up with what only the other had, nothing twice */
+static void assert_synced(const struct peer &p) {
+  TEST_ASSERT_EQUAL(OWN_BLOCKS, p.received.size());
+  for (int i = 0; i < OWN_BLOCKS; i++) {
+    const std::string hash = hash_of(blocks[i]);
+    TEST_ASSERT_TRUE(std::find(p.received.begin(), p.received.end(), hash) != p.received.end());
+  }
+  for (int i = OWN_BLOCKS; i < OWN_BLOCKS + SHARED_BLOCKS + PEER_BLOCKS; i++) {
+    pr_iterator_t iter = {};
+    TEST_ASSERT_GREATER_OR_EQUAL(0, pr_find_by_hash(&iter, (const uint8_t*)hash_of(blocks[i]).data()));
+    pr_iter_deinit(&iter);
+  }
+  TEST_ASSERT_EQUAL(OWN_BLOCKS + SHARED_BLOCKS + PEER_BLOCKS, pr_sync_size());
+}
+
+TEST_CASE("recon batches fill the window, credit comes back with acks", "[recon]") {
+  struct peer p = {};
+  p.window = RECON_WINDOW;
+  setup(p);
+  struct trace t = sync_with(p);
+  TEST_ASSERT_EQUAL(RECON_WINDOW, p.offered);
+  TEST_ASSERT_EQUAL(RECON_WINDOW, t.max_outstanding);
+  TEST_ASSERT_EQUAL(0, t.outstanding); /* all acked before closing */
+  TEST_ASSERT_EQUAL(0, p.n_exchanges);
+  TEST_ASSERT_GREATER_THAN(0, p.n_pure_acks);
+  assert_synced(p);
+  teardown();
+}
+
+TEST_CASE("recon falls back to the baseline exchange with a legacy peer", "[recon]") {
+  struct peer p = {};
+  p.baseline = 1;
+  setup(p);
+  struct trace t = sync_with(p);
+  TEST_ASSERT_FALSE(p.dropped);
+  TEST_ASSERT_EQUAL(0, p.n_batches);
+  TEST_ASSERT_EQUAL(0, t.max_outstanding);
+  /* one want and one block per round trip */
+  TEST_ASSERT_GREATER_OR_EQUAL(std::max(OWN_BLOCKS, PEER_BLOCKS), p.n_exchanges);
+  assert_synced(p);
+  teardown();
+}
+
+TEST_CASE("recon window is taken from want[0] of the hello answer", "[recon]") {
+  struct peer p = {};
+  p.window = 2;
+  setup(p);
+  struct trace t = sync_with(p);
+  TEST_ASSERT_EQUAL(RECON_WINDOW, p.offered);
+  TEST_ASSERT_EQUAL(2, t.max_outstanding);
+  assert_synced(p);
+  teardown();
+}
+
+TEST_CASE("recon hello to a peer that does not answer it", "[recon]") {
+  struct peer p = {};
+  p.baseline = 1;
+  setup(p);
+  struct trace t = sync_with(p);
+  TEST_ASSERT_EQUAL(RECON_WINDOW, p.offered); /* sent, answered with a plain T_EXCHANGE */
+  TEST_ASSERT_FALSE(p.dropped);
+  TEST_ASSERT_EQUAL(0, t.max_outstanding);
+  assert_synced(p);
+  teardown();
+}
+
+static void *open_responder(pwire_handlers_t *h) {
+  pwire_event_t ev = { .initiator = 0, .message = NULL, .size = 0, .session = NULL };
+  TEST_ASSERT_EQUAL(PW_REPLY, h->on_open(&ev));
+  return ev.session;
+}
+
+static void close_responder(pwire_handlers_t *h, void *session) {
+  pwire_event_t ev = { .initiator = 0, .message = NULL, .size = 0, .session = session };
+  h->on_close(&ev);
+}
+
+/* Feeds one frame to a non-initiator session */
+static pwire_ret_t respond(pwire_handlers_t *h, void *session, std::string frame, std::string *reply) {
+  pwire_event_t ev = { .initiator = 0, .message = (uint8_t*)frame.data(), .size = (uint32_t)frame.size(), .session = session };
+  pwire_ret_t r = h->on_data(&ev);
+  if (reply != NULL && (r == PW_REPLY || r == PW_REPLY_MORE)) reply->assign((const char*)ev.message, ev.size);
+  return r;
+}
+
+TEST_CASE("recon responder acks batches, empty ones are free", "[recon]") {
+  struct peer p = {};
+  setup(p);
+  pwire_handlers_t *h = recon_init_io();
+  void *session = open_responder(h);
+  struct recon_session *s = (struct recon_session*) session;
+
+  /* a block costs a credit, answered by a batch holding only the ack */
+  const std::string &block = p.blocks.begin()->second;
+  std::string batch(sizeof(struct batch_header), '\0'), reply;
+  struct batch_give g = { .hops = 1, .size = (uint16_t)block.size() };
+  batch.append((const char*)&g, sizeof(g));
+  batch.append(block);
+  ((struct batch_header*) batch.data())->type = T_BATCH;
+  ((struct batch_header*) batch.data())->n_gives = 1;
+  TEST_ASSERT_EQUAL(PW_REPLY, respond(h, session, batch, &reply));
+  TEST_ASSERT_EQUAL(sizeof(struct batch_header), reply.size());
+  const struct batch_header *b = (const struct batch_header*) reply.data();
+  TEST_ASSERT_EQUAL(T_BATCH, b->type);
+  TEST_ASSERT_EQUAL(0, b->n_wants);
+  TEST_ASSERT_EQUAL(0, b->n_gives);
+  TEST_ASSERT_EQUAL(1, b->ack);
+  TEST_ASSERT_EQUAL(s->window, s->credit); /* pure acks cost nothing */
+
+  /* an empty batch is never acked */
+  std::string empty(sizeof(struct batch_header), '\0');
+  empty[0] = T_BATCH;
+  TEST_ASSERT_EQUAL(PW_NOOP, respond(h, session, empty, NULL));
+  TEST_ASSERT_EQUAL(0, s->unacked);
+
+  close_responder(h, session); /* flushes the staged block */
+  pr_iterator_t iter = {};
+  TEST_ASSERT_GREATER_OR_EQUAL(0, pr_find_by_hash(&iter, (const uint8_t*)p.blocks.begin()->first.data()));
+  pr_iter_deinit(&iter);
+  teardown();
+}
+
+TEST_CASE("recon responder agrees on the smaller window", "[recon]") {
+  struct peer p = {};
+  setup(p);
+  pwire_handlers_t *h = recon_init_io();
+  void *session = open_responder(h);
+  std::string hello(sizeof(struct exchange_packet), '\0'), reply;
+  hello[0] = T_EXCHANGE | T_HELLO;
+  for (int offer = 0; offer <= RECON_WINDOW + 1; offer++) {
+    hello[1] = offer;
+    TEST_ASSERT_EQUAL(PW_REPLY, respond(h, session, hello, &reply));
+    TEST_ASSERT_EQUAL(sizeof(struct exchange_packet), reply.size());
+    TEST_ASSERT_EQUAL(T_EXCHANGE | T_HELLO, reply[0]);
+    TEST_ASSERT_EQUAL(std::max(1, std::min(offer, RECON_WINDOW)), reply[1]);
+    TEST_ASSERT_EQUAL(reply[1], ((struct recon_session*) session)->window);
+  }
+  close_responder(h, session);
+  teardown();
+}
+
+#define SYNC_BLOCKS 300 /* several sync chunks */
+
+/* Same items, order and fingerprints as negentropy's own storage */
+static void assert_storage_matches(negentropy::storage::Vector &ref) {
+  TEST_ASSERT_EQUAL(ref.size(), storage.size());
+  for (size_t i = 0; i < ref.size(); i++) TEST_ASSERT_TRUE(ref.getItem(i) == storage.getItem(i));
+  for (size_t begin = 0; begin <= ref.size(); begin += 7) {
+    for (size_t end = begin; end <= ref.size(); end += 13) {
+      TEST_ASSERT_TRUE(ref.fingerprint(begin, end).sv() == storage.fingerprint(begin, end).sv());
+    }
+  }
+  for (size_t i = 0; i < ref.size(); i += 5) {
+    const negentropy::Bound bound(ref.getItem(i));
+    TEST_ASSERT_EQUAL(i, storage.findLowerBound(0, storage.size(), bound));
+    TEST_ASSERT_EQUAL(i, ref.findLowerBound(0, ref.size(), bound));
+  }
+}
+
+TEST_CASE("sync index sums match negentropy fingerprints", "[recon][sync]") {
+  unlink(IMAGE);
+  pr_posix_config_t config = { .path = IMAGE };
+  pr_backend_posix_config(&config);
+  TEST_ASSERT_EQUAL(0, pr_init());
+  pico_keypair_t pair = {0};
+  pico_crypto_keypair(&pair);
+  static uint8_t *sync_blocks[SYNC_BLOCKS];
+  negentropy::storage::Vector all, kept;
+  for (int i = 0; i < SYNC_BLOCKS; i++) {
+    sync_blocks[i] = make_block(pair, i, 16 + (i * 29) % 300);
+    TEST_ASSERT_GREATER_OR_EQUAL(0, pr_write_block(sync_blocks[i], 1));
+    const uint64_t date = pf_read_utc(((const pf_block_t*)sync_blocks[i])->net.date);
+    all.insert(date, hash_of(sync_blocks[i]));
+    if (i % 4) kept.insert(date, hash_of(sync_blocks[i]));
+  }
+  all.seal();
+  kept.seal();
+  assert_storage_matches(all);
+
+  /* deletes shrink chunks, restored from checkpoint as they were */
+  for (int i = 0; i < SYNC_BLOCKS; i += 4) {
+    TEST_ASSERT_GREATER_OR_EQUAL(0, pr_delete_block((const uint8_t*)hash_of(sync_blocks[i]).data()));
+  }
+  assert_storage_matches(kept);
+  TEST_ASSERT_EQUAL(1, pr_checkpoint());
+  pr_deinit();
+  TEST_ASSERT_EQUAL(0, pr_init());
+  assert_storage_matches(kept);
+  pr_deinit();
+  for (int i = 0; i < SYNC_BLOCKS; i++) free(sync_blocks[i]);
+  unlink(IMAGE);
+}
@@ -0,0 +1,550 @@
+#include "unity.h"
+#include "repo.h"
+#include "repo_backend.h"
+#include "store.h"
+#include "picofeed.h"
+#include "test_util.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define IMAGE "host_test_PiC0.img"
+#define N_BLOCKS 200
+#define SECTOR_BYTES 4096
+
+static uint8_t *blocks[N_BLOCKS];
+static uint8_t hashes[N_BLOCKS][32];
+
+static void repo_open(int fresh) {
+  if (fresh) unlink(IMAGE);
+  pr_backend_posix_config(&(pr_posix_config_t){ .path = IMAGE });
+  TEST_ASSERT_EQUAL(0, pr_init());
+}
+
+static void repo_close(int remove) {
+  pr_deinit();
+  if (remove) unlink(IMAGE);
+}
+
+static void assert_missing(int i) {
+  pr_iterator_t iter = {0};
+  TEST_ASSERT_EQUAL(-1, pr_find_by_hash(&iter, hashes[i]));
+  pr_iter_deinit(&iter);
+}
+
+static void make_blocks(int n) {
+  pico_keypair_t pair = {0};
+  pico_crypto_keypair(&pair);
+  for (int i = 0; i < n; i++) blocks[i] = make_block(pair, i, 16 + (i * 53) % 700);
+}
+
+static void free_blocks(int n) {
+  for (int i = 0; i < n; i++) free(blocks[i]);
+}
+
+/* Writes blocks [from, to) one by one, keeps their hashes */
+static void write_blocks(int from, int to) {
+  for (int i = from; i < to; i++) {
+    pr_write_req_t req = { .block_bytes = blocks[i], .hops = 1 };
+    TEST_ASSERT_EQUAL(1, pr_write_blocks(&req, 1));
+    TEST_ASSERT_GREATER_OR_EQUAL(0, req.result);
+    memcpy(hashes[i], req.hash, 32);
+  }
+}
+
+/* Found by hash and reads back intact */
+static void assert_stored(int i) {
+  pr_iterator_t iter = {0};
+  TEST_ASSERT_GREATER_OR_EQUAL(0, pr_find_by_hash(&iter, hashes[i]));
+  const pf_block_t *block = pr_iter_load_body(&iter);
+  TEST_ASSERT_NOT_NULL(block);
+  TEST_ASSERT_EQUAL_MEMORY(blocks[i], block, pf_sizeof((const pf_block_t*)blocks[i]));
+  pr_iter_deinit(&iter);
+}
+
+static int count_by_date(void) {
+  int n = 0;
+  uint64_t last = 0;
+  pr_iterator_t iter = { .mode = PR_ITER_HEADERS };
+  while (!pr_iter_by_date(&iter, 0, UINT64_MAX, 0)) {
+    const uint64_t date = pf_read_utc(iter.block->net.date);
+    TEST_ASSERT_TRUE(last <= date);
+    last = date;
+    n++;
+  }
+  pr_iter_deinit(&iter);
+  return n;
+}
+
+static void assert_contents(int n) {
+  for (int i = 0; i < n; i++) assert_stored(i);
+  TEST_ASSERT_EQUAL(n, count_by_date());
+  TEST_ASSERT_EQUAL(n, pr_sync_size());
+}
+
+TEST_CASE("checkpoint restores index after reboot", "[repo][checkpoint]") {
+  repo_open(1);
+  make_blocks(N_BLOCKS);
+  write_blocks(0, N_BLOCKS / 2);
+  TEST_ASSERT_EQUAL(1, pr_checkpoint());
+  TEST_ASSERT_EQUAL(0, pr_checkpoint()); /* nothing changed */
+
+  /* Every sector restored, a rescan would have asked for a new checkpoint */
+  repo_close(0);
+  repo_open(0);
+  assert_contents(N_BLOCKS / 2);
+  TEST_ASSERT_EQUAL(0, pr_checkpoint());
+
+  /* Sectors written after the checkpoint are rescanned */
+  write_blocks(N_BLOCKS / 2, N_BLOCKS);
+  repo_close(0);
+  repo_open(0);
+  assert_contents(N_BLOCKS);
+  TEST_ASSERT_EQUAL(1, pr_checkpoint());
+  repo_close(0);
+  repo_open(0);
+  assert_contents(N_BLOCKS);
+  TEST_ASSERT_EQUAL(0, pr_checkpoint());
+  repo_close(1);
+  free_blocks(N_BLOCKS);
+}
+
+/* Offset of block i in a copy of the image */
+static long image_offset(const uint8_t *image, long size, int i) {
+  const size_t block_size = pf_sizeof((const pf_block_t*)blocks[i]);
+  for (long at = 0; at + block_size <= size; at++) {
+    if (0 == memcmp(image + at, blocks[i], block_size)) return at;
+  }
+  TEST_FAIL_MESSAGE("block not in image");
+  return -1;
+}
+
+static uint8_t *image_read(int fd, long *size) {
+  struct stat st;
+  TEST_ASSERT_EQUAL(0, fstat(fd, &st));
+  uint8_t *image = malloc(st.st_size);
+  TEST_ASSERT_EQUAL(st.st_size, pread(fd, image, st.st_size, 0));
+  *size = st.st_size;
+  return image;
+}
+
+/**
+ * Overwrites the sector holding block dst with the one holding src
+ * behind the repo's back, like an erase that never made it into the
+ * wear log. Blocks that were in the overwritten sector are flagged lost.
+ */
+static void copy_sector(int src, int dst, int n, uint8_t *lost) {
+  int fd = open(IMAGE, O_RDWR);
+  TEST_ASSERT_GREATER_OR_EQUAL(0, fd);
+  long size;
+  uint8_t *image = image_read(fd, &size);
+  long sector_of[N_BLOCKS];
+  for (int i = 0; i < n; i++) sector_of[i] = image_offset(image, size, i) / SECTOR_BYTES;
+  TEST_ASSERT_NOT_EQUAL(sector_of[src], sector_of[dst]);
+  for (int i = 0; i < n; i++) lost[i] = sector_of[i] == sector_of[dst];
+  TEST_ASSERT_EQUAL(SECTOR_BYTES, pwrite(fd, image + sector_of[src] * SECTOR_BYTES, SECTOR_BYTES, sector_of[dst] * SECTOR_BYTES));
+  free(image);
+  close(fd);
+}
+
+/* Flips the last byte of block i behind the repo's back */
+static void corrupt_block(int i) {
+  int fd = open(IMAGE, O_RDWR);
+  TEST_ASSERT_GREATER_OR_EQUAL(0, fd);
+  long size;
+  uint8_t *image = image_read(fd, &size);
+  const long at = image_offset(image, size, i) + pf_sizeof((const pf_block_t*)blocks[i]) - 1;
+  const uint8_t b = ~image[at];
+  TEST_ASSERT_EQUAL(1, pwrite(fd, &b, 1, at));
+  free(image);
+  close(fd);
+}
+
+TEST_CASE("stale checkpoint entries are rescanned", "[repo][checkpoint]") {
+  enum { n = 32 };
+  pico_keypair_t pair = {0};
+  pico_crypto_keypair(&pair);
+  /* Same size everywhere, every full sector has the same page directory */
+  for (int i = 0; i < n; i++) blocks[i] = make_block(pair, i, 700);
+  repo_open(1);
+  write_blocks(0, n);
+  TEST_ASSERT_EQUAL(1, pr_checkpoint());
+  repo_close(0);
+
+  uint8_t lost[n];
+  copy_sector(n / 2, 0, n, lost);
+  repo_open(0);
+  int n_lost = 0;
+  for (int i = 0; i < n; i++) {
+    if (lost[i]) assert_missing(i);
+    else assert_stored(i);
+    n_lost += lost[i];
+  }
+  TEST_ASSERT_GREATER_THAN(0, n_lost);
+  /* the copies are real records now, the index follows flash */
+  TEST_ASSERT_EQUAL(count_by_date(), pr_sync_size());
+  TEST_ASSERT_GREATER_OR_EQUAL(n - n_lost, count_by_date());
+  repo_close(1);
+  free_blocks(n);
+}
+
+TEST_CASE("duplicates are rejected, also within a batch and after reboot", "[repo]") {
+  repo_open(1);
+  make_blocks(8);
+  write_blocks(0, 4);
+  TEST_ASSERT_EQUAL(PR_ERROR_DUPLICATE, pr_write_block(blocks[2], 1));
+  pr_write_req_t reqs[3] = {
+    { .block_bytes = blocks[4], .hops = 1 },
+    { .block_bytes = blocks[4], .hops = 2 },
+    { .block_bytes = blocks[0], .hops = 1 }
+  };
+  TEST_ASSERT_EQUAL(1, pr_write_blocks(reqs, 3));
+  TEST_ASSERT_GREATER_OR_EQUAL(0, reqs[0].result);
+  TEST_ASSERT_EQUAL(PR_ERROR_DUPLICATE, reqs[1].result);
+  TEST_ASSERT_EQUAL(PR_ERROR_DUPLICATE, reqs[2].result);
+  memcpy(hashes[4], reqs[0].hash, 32);
+  repo_close(0);
+  repo_open(0);
+  for (int i = 0; i < 5; i++) TEST_ASSERT_EQUAL(PR_ERROR_DUPLICATE, pr_write_block(blocks[i], 1));
+  assert_contents(5);
+  repo_close(1);
+  free_blocks(8);
+}
+
+static uint8_t gone[N_BLOCKS][32];
+static int n_gone = 0;
+
+static void on_gone(const uint8_t *hash) {
+  TEST_ASSERT_LESS_THAN(N_BLOCKS, n_gone);
+  memcpy(gone[n_gone++], hash, 32);
+}
+
+TEST_CASE("deleted blocks stay deleted, compact reclaims their sectors", "[repo]") {
+  repo_open(1);
+  make_blocks(N_BLOCKS);
+  write_blocks(0, N_BLOCKS);
+  n_gone = 0;
+  pr_set_evict_handler(on_gone);
+  /* first half entirely, every third of the rest */
+  int n_deleted = 0;
+  for (int i = 0; i < N_BLOCKS; i++) {
+    if (i >= N_BLOCKS / 2 && i % 3) continue;
+    TEST_ASSERT_GREATER_OR_EQUAL(0, pr_delete_block(hashes[i]));
+    TEST_ASSERT_EQUAL(-1, pr_delete_block(hashes[i]));
+    TEST_ASSERT_EQUAL_MEMORY(hashes[i], gone[n_deleted], 32);
+    n_deleted++;
+  }
+  TEST_ASSERT_EQUAL(n_deleted, n_gone);
+  pr_set_evict_handler(NULL);
+
+  pr_wear_t before, after;
+  pr_wear_stats(&before);
+  const int erased = pr_compact(N_BLOCKS);
+  TEST_ASSERT_GREATER_THAN(0, erased);
+  TEST_ASSERT_EQUAL(0, pr_compact(N_BLOCKS)); /* nothing left to reclaim */
+  pr_wear_stats(&after);
+  TEST_ASSERT_EQUAL(before.total_erases + erased, after.total_erases);
+
+  /* tombstones in sectors that were not reclaimed survive reboot */
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < N_BLOCKS; i++) {
+      if (i < N_BLOCKS / 2 || i % 3 == 0) assert_missing(i);
+      else assert_stored(i);
+    }
+    TEST_ASSERT_EQUAL(N_BLOCKS - n_deleted, count_by_date());
+    TEST_ASSERT_EQUAL(N_BLOCKS - n_deleted, pr_sync_size());
+    repo_close(0);
+    repo_open(0);
+  }
+  /* reclaimed space is written again */
+  for (int i = 0; i < N_BLOCKS / 2; i++) TEST_ASSERT_GREATER_OR_EQUAL(0, pr_write_block(blocks[i], 1));
+  repo_close(1);
+  free_blocks(N_BLOCKS);
+}
+
+TEST_CASE("wear log counts every erase across reboots", "[repo][wear]") {
+  repo_open(1);
+  pr_wear_t wear;
+  pr_wear_stats(&wear);
+  TEST_ASSERT_EQUAL(0, wear.total_erases);
+  make_blocks(N_BLOCKS);
+  /* each round erases the sectors it deleted */
+  uint32_t total = 0;
+  for (int round = 0; round < 4; round++) {
+    write_blocks(0, N_BLOCKS);
+    for (int i = 0; i < N_BLOCKS; i++) TEST_ASSERT_GREATER_OR_EQUAL(0, pr_delete_block(hashes[i]));
+    pr_compact(N_BLOCKS);
+    pr_wear_stats(&wear);
+    TEST_ASSERT_GREATER_THAN(total, wear.total_erases);
+    total = wear.total_erases;
+    repo_close(0);
+    repo_open(0);
+    pr_wear_stats(&wear);
+    TEST_ASSERT_EQUAL(total, wear.total_erases);
+  }
+  TEST_ASSERT_LESS_OR_EQUAL(wear.max_erases, wear.min_erases);
+  TEST_ASSERT_EQUAL(1, wear.max_erases); /* never-erased sectors are opened first */
+  int sectors = 0;
+  for (int b = 0; b < PR_WEAR_BINS; b++) sectors += wear.bins[b];
+  TEST_ASSERT_GREATER_THAN(0, sectors);
+  repo_close(1);
+  free_blocks(N_BLOCKS);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  const uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+TEST_CASE("time and author iterators visit exactly their blocks", "[repo][iter]") {
+  enum { n_authors = 3, per_author = 30 };
+  repo_open(1);
+  for (int a = 0; a < n_authors; a++) {
+    pico_keypair_t pair = {0};
+    pico_crypto_keypair(&pair);
+    for (int i = 0; i < per_author; i++) blocks[a * per_author + i] = make_block(pair, a * per_author + i, 64);
+  }
+  const int n = n_authors * per_author;
+  write_blocks(0, n);
+  uint64_t dates[N_BLOCKS];
+  for (int i = 0; i < n; i++) dates[i] = pf_read_utc(((const pf_block_t*)blocks[i])->net.date);
+  qsort(dates, n, sizeof(uint64_t), cmp_u64);
+
+  /* [from, to) both ways */
+  const uint64_t from = dates[n / 4], to = dates[3 * n / 4];
+  int expected = 0;
+  for (int i = 0; i < n; i++) expected += dates[i] >= from && dates[i] < to;
+  for (int newest_first = 0; newest_first < 2; newest_first++) {
+    int found = 0;
+    uint64_t last = newest_first ? UINT64_MAX : 0;
+    pr_iterator_t iter = { .mode = PR_ITER_HEADERS };
+    while (!pr_iter_by_date(&iter, from, to, newest_first)) {
+      const uint64_t date = pf_read_utc(iter.block->net.date);
+      TEST_ASSERT_TRUE(date >= from && date < to);
+      TEST_ASSERT_TRUE(newest_first ? date <= last : date >= last);
+      last = date;
+      found++;
+    }
+    pr_iter_deinit(&iter);
+    TEST_ASSERT_EQUAL(expected, found);
+  }
+
+  for (int a = 0; a < n_authors; a++) {
+    const uint8_t *author = ((const pf_block_t*)blocks[a * per_author])->net.author;
+    int found = 0;
+    pr_iterator_t iter = { .mode = PR_ITER_FULL };
+    while (!pr_iter_by_author(&iter, author)) {
+      TEST_ASSERT_EQUAL_MEMORY(author, iter.block->net.author, 32);
+      found++;
+    }
+    pr_iter_deinit(&iter);
+    TEST_ASSERT_EQUAL(per_author, found);
+  }
+  /* deleted blocks leave both indices */
+  TEST_ASSERT_GREATER_OR_EQUAL(0, pr_delete_block(hashes[0]));
+  TEST_ASSERT_EQUAL(n - 1, count_by_date());
+  int found = 0;
+  pr_iterator_t iter = { .mode = PR_ITER_HEADERS };
+  while (!pr_iter_by_author(&iter, ((const pf_block_t*)blocks[0])->net.author)) found++;
+  pr_iter_deinit(&iter);
+  TEST_ASSERT_EQUAL(per_author - 1, found);
+  repo_close(1);
+  free_blocks(n);
+}
+
+TEST_CASE("block cache serves repeated lookups", "[repo][cache]") {
+  repo_open(1);
+  make_blocks(16);
+  write_blocks(0, 16);
+  repo_close(0);
+  repo_open(0); /* cold cache */
+  pr_cache_stats_t stats;
+  pr_cache_stats(&stats);
+  TEST_ASSERT_EQUAL(0, stats.entries);
+  TEST_ASSERT_GREATER_THAN(0, stats.budget);
+  const uint32_t hits_before = stats.hits; /* counters only ever grow */
+  for (int i = 0; i < 16; i++) assert_stored(i);
+  pr_cache_stats(&stats);
+  const uint32_t misses = stats.misses, hits = stats.hits;
+  TEST_ASSERT_EQUAL(hits_before, hits);
+  TEST_ASSERT_EQUAL(16, stats.entries);
+  for (int i = 0; i < 16; i++) assert_stored(i);
+  pr_cache_stats(&stats);
+  TEST_ASSERT_EQUAL(misses, stats.misses);
+  TEST_ASSERT_EQUAL(hits + 16, stats.hits);
+  TEST_ASSERT_LESS_OR_EQUAL(stats.budget, stats.bytes);
+  /* deleted blocks are not served from cache */
+  TEST_ASSERT_GREATER_OR_EQUAL(0, pr_delete_block(hashes[3]));
+  assert_missing(3);
+  repo_close(1);
+  free_blocks(16);
+}
+
+#define COLD_IMAGE "host_test_sd0.img"
+#define COLD_SECTORS 8192
+
+TEST_CASE("cached cold blocks follow decay", "[repo][cache][cold]") {
+  unlink(COLD_IMAGE);
+  int fd = open(COLD_IMAGE, O_RDWR | O_CREAT, 0644);
+  TEST_ASSERT_GREATER_OR_EQUAL(0, fd);
+  TEST_ASSERT_EQUAL(0, ftruncate(fd, (off_t)COLD_SECTORS * STORE_SECTOR_SIZE));
+  close(fd);
+  setenv("STORE_HOST_IMAGE", COLD_IMAGE, 1);
+  repo_open(1);
+  TEST_ASSERT_EQUAL(0, pr_cold_attach());
+  make_blocks(32);
+  write_blocks(0, 32);
+  for (int n = 0; n < 64 && pr_cold_migrate(INT16_MAX); n++);
+
+  pr_iterator_t iter = {0};
+  const int slot = pr_find_by_hash(&iter, hashes[0]);
+  TEST_ASSERT_GREATER_OR_EQUAL(PR_COLD_SLOT, slot);
+  TEST_ASSERT_NOT_NULL(pr_iter_load_body(&iter)); /* now cached */
+  const int shares = pr_decay(slot, hashes[0], 3);
+  TEST_ASSERT_GREATER_THAN(iter.meta.decay, shares);
+  pr_iter_deinit(&iter);
+
+  pr_cache_stats_t stats;
+  pr_cache_stats(&stats);
+  const uint32_t hits = stats.hits;
+  TEST_ASSERT_EQUAL(slot, pr_find_by_hash(&iter, hashes[0]));
+  pr_cache_stats(&stats);
+  TEST_ASSERT_EQUAL(hits + 1, stats.hits);
+  TEST_ASSERT_EQUAL(shares, iter.meta.decay);
+  pr_iter_deinit(&iter);
+  repo_close(1);
+  free_blocks(32);
+  unlink(COLD_IMAGE);
+}
+
+TEST_CASE("scan visits every record once, verify entombs corrupt ones", "[repo][scan]") {
+  repo_open(1);
+  make_blocks(N_BLOCKS);
+  write_blocks(0, N_BLOCKS);
+  for (int depth = 2; depth <= PR_SCAN_DEPTH + 1; depth++) {
+    static uint8_t seen[N_BLOCKS];
+    memset(seen, 0, sizeof(seen));
+    int n = 0;
+    pr_iterator_t iter = {0};
+    pr_scan_t *scan = pr_scan_open(depth);
+    TEST_ASSERT_NOT_NULL(scan);
+    while (!pr_scan_next(scan, &iter)) {
+      int i = 0;
+      while (i < N_BLOCKS && memcmp(hashes[i], iter.meta.hash, 32)) i++;
+      TEST_ASSERT_LESS_THAN(N_BLOCKS, i);
+      TEST_ASSERT_EQUAL_MEMORY(blocks[i], iter.block, pf_sizeof((const pf_block_t*)blocks[i]));
+      TEST_ASSERT_FALSE(seen[i]);
+      seen[i] = 1;
+      n++;
+    }
+    pr_scan_close(scan);
+    TEST_ASSERT_EQUAL(N_BLOCKS, n);
+  }
+  TEST_ASSERT_EQUAL(0, pr_verify());
+
+  /* flip bits of a body behind the repo's back */
+  repo_close(0);
+  corrupt_block(7);
+  repo_open(0);
+  TEST_ASSERT_EQUAL(1, pr_verify());
+  assert_missing(7);
+  TEST_ASSERT_EQUAL(0, pr_verify());
+  TEST_ASSERT_EQUAL(N_BLOCKS - 1, count_by_date());
+  repo_close(1);
+  free_blocks(N_BLOCKS);
+}
+
+/**
+ * Power loss emulation, once writes_left runs out the image is
+ * copied as it is to CRASH_IMAGE, a write in flight only halfway.
+ */
+#define CRASH_IMAGE "host_test_PiC0_crash.img"
+#define CRASH_BLOCKS 12
+static int writes_left = -1;
+
+static void snapshot(void) {
+  static uint8_t sector[SECTOR_BYTES];
+  int src = open(IMAGE, O_RDONLY), dst = open(CRASH_IMAGE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  TEST_ASSERT_TRUE(src >= 0 && dst >= 0);
+  while (read(src, sector, sizeof(sector)) == sizeof(sector)) {
+    TEST_ASSERT_EQUAL(sizeof(sector), write(dst, sector, sizeof(sector)));
+  }
+  close(src);
+  close(dst);
+}
+
+static int crash_open(pr_geometry_t *geometry) {
+  return pr_backend_posix.open(geometry);
+}
+
+static void crash_close(void) {
+  pr_backend_posix.close();
+}
+
+static esp_err_t crash_read(size_t offset, void *dst, size_t size) {
+  return pr_backend_posix.read(offset, dst, size);
+}
+
+static esp_err_t crash_write(size_t offset, const void *src, size_t size) {
+  if (writes_left == 0) {
+    TEST_ASSERT_EQUAL(ESP_OK, pr_backend_posix.write(offset, src, size / 2));
+    snapshot();
+  }
+  if (writes_left >= 0) writes_left--;
+  return pr_backend_posix.write(offset, src, size);
+}
+
+static esp_err_t crash_erase(size_t offset, size_t size) {
+  if (writes_left == 0) snapshot();
+  if (writes_left >= 0) writes_left--;
+  return pr_backend_posix.erase(offset, size);
+}
+
+static const pr_backend_t crash_backend = {
+  .name = "crash",
+  .open = crash_open,
+  .close = crash_close,
+  .read = crash_read,
+  .write = crash_write,
+  .erase = crash_erase
+};
+
+TEST_CASE("torn records are skipped on boot and can be written again", "[repo][crash]") {
+  make_blocks(CRASH_BLOCKS);
+  /* Every write of the inserts in turn is the one cut short */
+  for (int budget = 0; ; budget++) {
+    pr_set_backend(&crash_backend);
+    repo_open(1);
+    writes_left = budget;
+    int committed = 0; /* writes that returned before the crash */
+    for (int i = 0; i < CRASH_BLOCKS; i++) {
+      write_blocks(i, i + 1);
+      if (writes_left >= 0) committed = i + 1;
+    }
+    const int crashed = writes_left < 0;
+    writes_left = -1;
+    repo_close(0);
+    pr_set_backend(&pr_backend_posix);
+    if (!crashed) break;
+
+    pr_backend_posix_config(&(pr_posix_config_t){ .path = CRASH_IMAGE });
+    TEST_ASSERT_EQUAL(0, pr_init());
+    for (int i = 0; i < committed; i++) assert_stored(i);
+    TEST_ASSERT_EQUAL(0, pr_verify()); /* nothing torn was indexed */
+    for (int i = committed; i < CRASH_BLOCKS; i++) {
+      const int res = pr_write_block(blocks[i], 1);
+      TEST_ASSERT_TRUE(res >= 0 || res == PR_ERROR_DUPLICATE);
+    }
+    for (int pass = 0; pass < 2; pass++) {
+      assert_contents(CRASH_BLOCKS);
+      pr_deinit();
+      TEST_ASSERT_EQUAL(0, pr_init());
+    }
+    pr_deinit();
+  }
+  free_blocks(CRASH_BLOCKS);
+  unlink(IMAGE);
+  unlink(CRASH_IMAGE);
+}
@@ -0,0 +1,249 @@
+#include "unity.h"
+#include "store.h"
+#include "test_util.h"
+#include "monocypher.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define IMAGE "host_test_sd0.img"
+#define CRASH_IMAGE "host_test_sd0_crash.img"
+#define IMAGE_SECTORS 8192
+#define N_BLOCKS 1000 /* three levels of B-tree */
+#define CRASH_BLOCKS 60 /* root grows once */
+#define SMALL_SECTORS 600 /* holds about 200 blocks */
+
+static uint8_t *blocks[N_BLOCKS];
+
+static void create_image(const char *path, int n_sectors) {
+  unlink(path);
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  TEST_ASSERT_GREATER_OR_EQUAL(0, fd);
+  TEST_ASSERT_EQUAL(0, ftruncate(fd, n_sectors * STORE_SECTOR_SIZE));
+  close(fd);
+  setenv("STORE_HOST_IMAGE", path, 1);
+}
+
+static void make_blocks(int n) {
+  pico_keypair_t pair = {0};
+  pico_crypto_keypair(&pair);
+  for (int i = 0; i < n; i++) blocks[i] = make_block(pair, i, 16 + (i * 53) % 700);
+}
+
+static void free_blocks(int n) {
+  for (int i = 0; i < n; i++) free(blocks[i]);
+}
+
+static void block_hash(int i, uint8_t *hash) {
+  crypto_blake2b(hash, 32, blocks[i], pf_sizeof((const pf_block_t*)blocks[i]));
+}
+
+/* Found by id and hash, reads back intact */
+static void assert_stored(int i) {
+  const pf_block_t *block = (const pf_block_t*)blocks[i];
+  const size_t size = pf_sizeof(block);
+  uint8_t hash[32];
+  block_hash(i, hash);
+  int record = store_find_by_id(block->net.id);
+  TEST_ASSERT_GREATER_THAN(0, record);
+  TEST_ASSERT_EQUAL(record, store_find_by_hash(hash));
+  static uint8_t buffer[STORE_MAX_BLOCK_SIZE];
+  store_meta_t meta = {0};
+  TEST_ASSERT_EQUAL(size, store_read_block(record, buffer, sizeof(buffer), &meta));
+  TEST_ASSERT_EQUAL_MEMORY(blocks[i], buffer, size);
+  TEST_ASSERT_EQUAL_MEMORY(hash, meta.hash, sizeof(hash));
+}
+
+static int count_records(void) {
+  uint32_t cursor = 0;
+  int n = 0;
+  while (store_iter_next(&cursor)) n++;
+  return n;
+}
+
+static void assert_contents(int n, int deleted_every) {
+  for (int i = 0; i < n; i++) {
+    if (deleted_every && i % deleted_every == 0) {
+      TEST_ASSERT_EQUAL(-1, store_find_by_id(((const pf_block_t*)blocks[i])->net.id));
+    } else {
+      assert_stored(i);
+    }
+  }
+  const int live = n - (deleted_every ? (n + deleted_every - 1) / deleted_every : 0);
+  TEST_ASSERT_EQUAL(live, store_list_blocks());
+  TEST_ASSERT_EQUAL(live, count_records());
+}
+
+TEST_CASE("store insert, find, delete and iterate", "[store]") {
+  create_image(IMAGE, IMAGE_SECTORS);
+  make_blocks(N_BLOCKS);
+  TEST_ASSERT_EQUAL(ESP_OK, storage_init(NULL));
+  for (int i = 0; i < N_BLOCKS; i++) {
+    TEST_ASSERT_GREATER_THAN(0, store_write_block(blocks[i], 1));
+  }
+  TEST_ASSERT_EQUAL(PR_ERROR_DUPLICATE, store_write_block(blocks[7], 1));
+  assert_contents(N_BLOCKS, 0);
+
+  for (int i = 0; i < N_BLOCKS; i += 3) {
+    int record = store_find_by_id(((const pf_block_t*)blocks[i])->net.id);
+    TEST_ASSERT_EQUAL(0, store_delete_block(record));
+    TEST_ASSERT_EQUAL(-1, store_delete_block(record));
+  }
+  assert_contents(N_BLOCKS, 3);
+
+  /* Survives reopen */
+  storage_deinit();
+  TEST_ASSERT_EQUAL(ESP_OK, storage_init(NULL));
+  assert_contents(N_BLOCKS, 3);
+  storage_deinit();
+  free_blocks(N_BLOCKS);
+  unlink(IMAGE);
+}
+
+/**
+ * Power loss emulation, once writes_left runs out the image
+ * is copied as it is on disk to CRASH_IMAGE.
+ */
+static int writes_left = -1;
+
+static void snapshot(void) {
+  static uint8_t sector[STORE_SECTOR_SIZE];
+  int src = open(IMAGE, O_RDONLY), dst = open(CRASH_IMAGE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  TEST_ASSERT_TRUE(src >= 0 && dst >= 0);
+  while (read(src, sector, sizeof(sector)) == sizeof(sector)) {
+    TEST_ASSERT_EQUAL(sizeof(sector), write(dst, sector, sizeof(sector)));
+  }
+  close(src);
+  close(dst);
+}
+
+static int crash_open(uint32_t *n_sectors) {
+  return store_device_file.open(n_sectors);
+}
+
+static void crash_close(void) {
+  store_device_file.close();
+}
+
+static esp_err_t crash_read(uint32_t sector, void *dst, size_t count) {
+  return store_device_file.read(sector, dst, count);
+}
+
+static esp_err_t crash_write(uint32_t sector, const void *src, size_t count) {
+  if (writes_left == 0) snapshot();
+  if (writes_left >= 0) writes_left--;
+  return store_device_file.write(sector, src, count);
+}
+
+static const store_device_t crash_device = {
+  .name = "crash",
+  .open = crash_open,
+  .close = crash_close,
+  .read = crash_read,
+  .write = crash_write
+};
+
+TEST_CASE("store survives power loss during inserts", "[store]") {
+  make_blocks(CRASH_BLOCKS);
+  /* Every write of the inserts in turn is the first one lost */
+  for (int budget = 0; ; budget++) {
+    create_image(IMAGE, IMAGE_SECTORS);
+    writes_left = budget;
+    TEST_ASSERT_EQUAL(ESP_OK, storage_init(&crash_device));
+    int committed = 0; /* inserts that returned before the crash */
+    for (int i = 0; i < CRASH_BLOCKS; i++) {
+      TEST_ASSERT_GREATER_THAN(0, store_write_block(blocks[i], 1));
+      if (writes_left >= 0) committed = i + 1;
+    }
+    storage_deinit();
+    if (writes_left >= 0) break; /* all writes made it */
+
+    setenv("STORE_HOST_IMAGE", CRASH_IMAGE, 1);
+    TEST_ASSERT_EQUAL(ESP_OK, storage_init(NULL));
+    for (int i = 0; i < committed; i++) assert_stored(i);
+    /* The torn insert is either complete or can be retried */
+    for (int i = committed; i < CRASH_BLOCKS; i++) {
+      int record = store_write_block(blocks[i], 1);
+      TEST_ASSERT_TRUE(record > 0 || record == PR_ERROR_DUPLICATE);
+    }
+    for (int i = 0; i < CRASH_BLOCKS; i++) assert_stored(i);
+    storage_deinit();
+  }
+  writes_left = -1;
+  free_blocks(CRASH_BLOCKS);
+  unlink(IMAGE);
+  unlink(CRASH_IMAGE);
+}
+
+static uint8_t evicted[N_BLOCKS][32];
+static int n_evicted = 0;
+
+static void on_evict(const uint8_t *hash) {
+  TEST_ASSERT_LESS_THAN(N_BLOCKS, n_evicted);
+  memcpy(evicted[n_evicted++], hash, 32);
+}
+
+static int was_evicted(int i) {
+  uint8_t hash[32];
+  block_hash(i, hash);
+  for (int e = 0; e < n_evicted; e++) {
+    if (0 == memcmp(evicted[e], hash, 32)) return 1;
+  }
+  return 0;
+}
+
+TEST_CASE("store reuses space of deleted blocks", "[store]") {
+  create_image(IMAGE, SMALL_SECTORS);
+  make_blocks(N_BLOCKS);
+  n_evicted = 0;
+  store_set_evict_handler(on_evict);
+  TEST_ASSERT_EQUAL(ESP_OK, storage_init(NULL));
+  /* five times what fits, deleted round by round */
+  for (int round = 0; round < 5; round++) {
+    for (int i = round * 100; i < (round + 1) * 100; i++) {
+      TEST_ASSERT_GREATER_THAN(0, store_write_block(blocks[i], 1));
+    }
+    for (int i = round * 100; i < (round + 1) * 100; i++) {
+      assert_stored(i);
+      TEST_ASSERT_EQUAL(0, store_delete_block(store_find_by_id(((const pf_block_t*)blocks[i])->net.id)));
+    }
+    TEST_ASSERT_EQUAL(0, store_list_blocks());
+    TEST_ASSERT_EQUAL(0, count_records());
+  }
+  TEST_ASSERT_EQUAL(0, n_evicted);
+  storage_deinit();
+  store_set_evict_handler(NULL);
+  free_blocks(N_BLOCKS);
+  unlink(IMAGE);
+}
+
+TEST_CASE("store evicts oldest blocks when full", "[store]") {
+  create_image(IMAGE, SMALL_SECTORS);
+  make_blocks(N_BLOCKS);
+  n_evicted = 0;
+  store_set_evict_handler(on_evict);
+  TEST_ASSERT_EQUAL(ESP_OK, storage_init(NULL));
+  for (int i = 0; i < N_BLOCKS; i++) {
+    TEST_ASSERT_GREATER_THAN(0, store_write_block(blocks[i], 1));
+  }
+  TEST_ASSERT_GREATER_THAN(N_BLOCKS / 2, n_evicted);
+  TEST_ASSERT_TRUE(was_evicted(0));
+  for (int i = N_BLOCKS - 20; i < N_BLOCKS; i++) TEST_ASSERT_FALSE(was_evicted(i));
+
+  /* Every block is either stored or reported evicted, also after reopen */
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < N_BLOCKS; i++) {
+      if (was_evicted(i)) TEST_ASSERT_EQUAL(-1, store_find_by_id(((const pf_block_t*)blocks[i])->net.id));
+      else assert_stored(i);
+    }
+    TEST_ASSERT_EQUAL(N_BLOCKS - n_evicted, store_list_blocks());
+    TEST_ASSERT_EQUAL(N_BLOCKS - n_evicted, count_records());
+    storage_deinit();
+    TEST_ASSERT_EQUAL(ESP_OK, storage_init(NULL));
+  }
+  storage_deinit();
+  store_set_evict_handler(NULL);
+  free_blocks(N_BLOCKS);
+  unlink(IMAGE);
+}
@@ -0,0 +1,26 @@
+#include "test_util.h"
+#include "unity.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+uint8_t *make_block(pico_keypair_t pair, int seq, size_t body_size) {
+  uint8_t body[1024];
+  TEST_ASSERT_LESS_OR_EQUAL(sizeof(body), body_size);
+  for (size_t i = 0; i < body_size; i++) body[i] = seq + i;
+  memcpy(body, &seq, sizeof(seq));
+  pico_feed_t feed = {0};
+  pf_init(&feed);
+  TEST_ASSERT_FALSE(pf_append(&feed, body, body_size, pair) < 0);
+  const pf_block_t *block = pf_get(&feed, 0);
+  uint8_t *copy = malloc(pf_sizeof(block));
+  memcpy(copy, block, pf_sizeof(block));
+  pf_deinit(&feed);
+  return copy;
+}
+
+double now_s(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
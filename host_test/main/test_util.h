@@ -0,0 +1,18 @@
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+#include "picofeed.h"
+#include <stdint.h>
+#include <stddef.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Genesis of a fresh feed, seq makes the body unique. Free with free() */
+uint8_t *make_block(pico_keypair_t pair, int seq, size_t body_size);
+
+/* Monotonic clock in seconds */
+double now_s(void);
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -1,31 +1,76 @@
 #include "picofeed.h"
 #include "repo.h"
-#include "esp_partition.h"
+#include "repo_backend.h"
+#include "store.h"
 #include "esp_log.h"
 #include "memory.h"
 #include <stdint.h>
+#include <stddef.h>
+#include <inttypes.h>
 #include <time.h>
 #include "monocypher.h"
-#define ESP_PARTITION_SUBTYPE_DATA_PiC0 87
-#define ESP_PARTITION_LABEL_PiC0 "PiC0"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#if !CONFIG_IDF_TARGET_LINUX
+#include "esp_heap_caps.h"
+#endif
 
 #define SLOT_GLYPH 0b10110001
-// #define FLAG_TOMB (1 << 1)
+#define SECTOR_GLYPH 0b10110010 /* differs from SLOT_GLYPH, pre-packing sectors are recycled as dirty */
+#define FLAG_TOMB (1 << 1) /* deleted, sector is reclaimed by pr_compact() */
 
-/* TODO: use values from partition info instead */
-#define SLOT_SIZE 4096
+/**
+ * Packed layout, each erase sector holds a small header
+ * with a page directory followed by PAGES_PER_SECTOR pages.
+ * Records (flash_slot) span 1..PAGES_PER_SECTOR contiguous pages,
+ * a slot-id addresses the first page of a record.
+ *
+ * [hdr|dir] [page0] [page1] ... [page7]
+ *
+ * Pages are claimed in order by writing the directory before
+ * the record, so unclaimed pages are always erased
+ * and can be appended to without another erase.
+ * A commit mark is written last, records without one were torn
+ * by power loss and are skipped until the sector is reclaimed.
+ */
+/* pr_init() checks backend geometry against these */
+#define SECTOR_SIZE 4096
 #define MEM_SIZE (0x200000)
-#define SLOT_OFFSET(s) ((((s) * SLOT_SIZE)) % MEM_SIZE)
+#define META_SECTORS 2 /* reserved at end of partition, see wear_meta */
+#define CKPT_REGIONS 2 /* reserved before meta, see ckpt_header */
+#define CKPT_SECTORS 22 /* per region */
+#define N_SECTORS (MEM_SIZE / SECTOR_SIZE - CKPT_REGIONS * CKPT_SECTORS - META_SECTORS)
+#define WEAR_SECTORS (N_SECTORS + CKPT_REGIONS * CKPT_SECTORS) /* erase counted, data & checkpoint */
+#define SECTOR_HEADER_SIZE 64
+#define PAGES_PER_SECTOR 8
+#define PAGE_BYTES ((SECTOR_SIZE - SECTOR_HEADER_SIZE) / PAGES_PER_SECTOR)
+#define SLOT_SIZE (PAGES_PER_SECTOR * PAGE_BYTES) /* largest record */
+#define N_SLOTS (N_SECTORS * PAGES_PER_SECTOR)
+#define SLOT_SECTOR(s) ((s) / PAGES_PER_SECTOR)
+#define SLOT_PAGE(s) ((s) % PAGES_PER_SECTOR)
+#define SECTOR_OFFSET(n) ((n) * SECTOR_SIZE)
+#define SLOT_OFFSET(s) (SECTOR_OFFSET(SLOT_SECTOR(s)) + SECTOR_HEADER_SIZE + SLOT_PAGE(s) * PAGE_BYTES)
+#define CKPT_SECTOR(r) (N_SECTORS + (r) * CKPT_SECTORS)
+#define CKPT_OFFSET(r) SECTOR_OFFSET(CKPT_SECTOR(r))
+#define META_OFFSET(m) SECTOR_OFFSET(WEAR_SECTORS + (m))
+
+/* Page directory entries */
+#define PAGE_FREE 0xff
+#define PAGE_HEAD 0b10110001 /* first page of record */
+#define PAGE_TAIL 0b00110001 /* continuation */
+#define PAGE_COMMIT 0b10100101 /* record fully written */
+#define WEAR_GLYPH 0b10111010 /* counts WEAR_SECTORS, was 0b10110100 */
+#define CKPT_GLYPH 0b10111011 /* two regions, was 0b10110101 */
 
 static const char TAG[] = "repo.c";
-/*
-struct pr_internal {
-  const void *mmap_ptr;
-  esp_partition_mmap_handle_t mmap_handle;
-};
-*/
 
-static const esp_partition_t *partition;
+/* Writers and compaction task are serialized, readers rely on mapped flash.
+ * Recursive so pr_sync_hold() can span several pr_sync_ calls */
+static SemaphoreHandle_t repo_mutex = NULL;
+#define REPO_LOCK() xSemaphoreTakeRecursive(repo_mutex, portMAX_DELAY)
+#define REPO_UNLOCK() xSemaphoreGiveRecursive(repo_mutex)
 
 /**
  * Understanding flash correctly, when erased
@@ -35,7 +80,7 @@ static const esp_partition_t *partition;
 struct __attribute__((packed)) flash_slot {
   uint8_t glyph;  /* magic */
   uint8_t iflags; /* inverted flags */
-  uint64_t decay; /* N-Shares counter */
+  uint64_t decay; /* N-Shares counter, leading zeroes, see pr_decay() */
   uint64_t stored_at; /* Wonky swarmtime */
   uint8_t hops;	  /* TTL */
   uint8_t hash[32]; /* Blake2b | builtin sha256 */
@@ -43,32 +88,654 @@ struct __attribute__((packed)) flash_slot {
   pf_block_t block; /* start of block */
 } ;
 
+struct __attribute__((packed)) sector_header {
+  uint8_t glyph; /* SECTOR_GLYPH once opened */
+  uint8_t pages[PAGES_PER_SECTOR]; /* page directory */
+  uint8_t commit[PAGES_PER_SECTOR]; /* PAGE_COMMIT on record heads */
+};
+_Static_assert(sizeof(struct sector_header) <= SECTOR_HEADER_SIZE, "sector header overflows");
+
+/**
+ * Erase counters, log-structured over the two meta sectors.
+ * A meta sector holds a snapshot followed by a log of
+ * sector-ids erased since, replayed during boot.
+ * When the log fills up a new snapshot is written to the other
+ * meta sector, glyph & generation last so a torn snapshot is ignored.
+ */
+struct wear_meta {
+  uint8_t glyph; /* WEAR_GLYPH */
+  uint32_t generation; /* highest valid wins */
+};
+#define WEAR_COUNTS_OFFSET sizeof(struct wear_meta) /* uint32_t[WEAR_SECTORS] */
+#define WEAR_LOG_OFFSET (WEAR_COUNTS_OFFSET + WEAR_SECTORS * sizeof(uint32_t)) /* uint16_t[] */
+#define WEAR_LOG_SIZE ((SECTOR_SIZE - WEAR_LOG_OFFSET) / sizeof(uint16_t))
+#define WEAR_LOG_EMPTY 0xffff
+
+/**
+ * Boot checkpoint, a compact copy of the in-RAM indices:
+ * [header] [sector table] [entries] [sync chunks]
+ * Written to the older of two regions, the valid header with the
+ * highest generation wins on boot, so a torn checkpoint falls back
+ * to the previous one. Erases are counted like data sectors.
+ * On boot each sector is checked against its erase count and
+ * header checksum, only sectors that changed since are rescanned.
+ * Shares & tombstones are updated in place and always read from
+ * the record, hops & full hashes are left to the iterators.
+ * Sync chunks are stored as is, n & sum followed by n slot-ids.
+ */
+struct __attribute__((packed)) ckpt_header {
+  uint8_t glyph; /* CKPT_GLYPH, written last */
+  uint32_t generation;
+  uint32_t n_entries;
+  uint32_t n_sync_chunks;
+};
+struct __attribute__((packed)) ckpt_sector {
+  uint32_t erases;
+  uint32_t sum; /* of sector_header, see header_sum() */
+};
+struct __attribute__((packed)) ckpt_entry {
+  uint16_t slot;
+  uint8_t pages;
+  uint64_t date;
+  uint32_t hash; /* prefix bytes as read by hash_prefix() */
+  uint32_t author;
+};
+#define CKPT_TABLE_OFFSET(r) (CKPT_OFFSET(r) + sizeof(struct ckpt_header))
+#define CKPT_ENTRIES_OFFSET(r) (CKPT_TABLE_OFFSET(r) + N_SECTORS * sizeof(struct ckpt_sector))
+#define CKPT_SYNC_OFFSET(r, n_entries) (CKPT_ENTRIES_OFFSET(r) + (n_entries) * sizeof(struct ckpt_entry))
+#define CKPT_CHUNK 32 /* entries per read/write */
+#define CKPT_MIN_CHANGES 32 /* writes & recycles worth an erase, see pr_checkpoint() */
+/* Kept off the stack, pr_checkpoint() runs on a small idle task. Guarded by REPO_LOCK */
+static struct ckpt_sector ckpt_table[CKPT_CHUNK];
+static struct ckpt_entry ckpt_entries[CKPT_CHUNK];
+
+/* Bytes occupied on flash by record holding block of size */
+#define RECORD_SIZE(block_size) (sizeof(flash_slot_t) - sizeof(pf_block_t) + (block_size))
+#define RECORD_PAGES(block_size) ((RECORD_SIZE(block_size) + PAGE_BYTES - 1) / PAGE_BYTES)
+
+struct pr_internal {
+  const uint8_t *mmap_ptr; /* NULL when mapping failed, reads fall back to copying */
+  int mounted; /* backend is open */
+  int compact; /* pr_compact() scan start */
+  int open; /* sector being appended to, -1 none */
+  int hdr_cached; /* sector in hdr_cache, -1 none */
+  int wear_meta; /* active meta sector, -1 none */
+  uint32_t wear_generation;
+  int wear_log; /* next free log entry */
+  int cold; /* SD-card store attached, see pr_cold_attach() */
+  int ckpt_changes; /* index changes since last checkpoint */
+  int ckpt_region; /* holding ckpt_generation, -1 none */
+  uint32_t ckpt_generation;
+  struct sector_header hdr_cache; /* last read header when unmapped */
+};
+static struct pr_internal state = { .open = -1, .hdr_cached = -1, .wear_meta = -1, .ckpt_region = -1 };
+
+#if CONFIG_IDF_TARGET_LINUX
+static const pr_backend_t *backend = &pr_backend_posix;
+#else
+static const pr_backend_t *backend = &pr_backend_esp;
+#endif
+
+void pr_set_backend(const pr_backend_t *b) {
+  backend = b;
+}
+
+static pr_evict_handler_t evict_handler = NULL;
+
+void pr_set_evict_handler(pr_evict_handler_t handler) {
+  evict_handler = handler;
+}
+
+/**
+ * Raw flash access, see repo_backend.h
+ * The unmapped header cache is dropped on every modification.
+ */
+static esp_err_t flash_read(size_t offset, void *dst, size_t size) {
+  return backend->read(offset, dst, size);
+}
+
+static esp_err_t flash_write(size_t offset, const void *src, size_t size) {
+  state.hdr_cached = -1;
+  return backend->write(offset, src, size);
+}
+
+static esp_err_t flash_erase(size_t offset, size_t size) {
+  state.hdr_cached = -1;
+  return backend->erase(offset, size);
+}
+
+/**
+ * In-RAM hash index, hash-prefix => slot id.
+ * Open addressing with linear probing, sized >= 2x N_SLOTS
+ * to keep load below 50% so lookups resolve in ~1 probe.
+ * Prefix collisions are weeded out by comparing the full
+ * hash after reading the slot, so a hit costs one flash read.
+ */
+#define HINDEX_SIZE 8192 /* power of two, >= 2x N_SLOTS */
+#define HINDEX_MASK (HINDEX_SIZE - 1)
+#define HINDEX_EMPTY UINT16_MAX
+_Static_assert((HINDEX_SIZE & HINDEX_MASK) == 0 && HINDEX_SIZE >= N_SLOTS * 2, "bad hash index size");
+
+struct __attribute__((packed)) hindex_entry {
+  uint32_t prefix; /* first 4 bytes of hash */
+  uint16_t slot;
+};
+static struct hindex_entry hindex[HINDEX_SIZE];
+
+static uint32_t hash_prefix(const uint8_t *hash) {
+  uint32_t prefix;
+  memcpy(&prefix, hash, sizeof(prefix)); /* blake2b output is uniform enough */
+  return prefix;
+}
+
+static void hindex_clear(void) {
+  for (int i = 0; i < HINDEX_SIZE; i++) hindex[i].slot = HINDEX_EMPTY;
+}
+
+static void hindex_insert(const uint8_t *hash, uint16_t slot) {
+  uint32_t prefix = hash_prefix(hash);
+  uint32_t i = prefix & HINDEX_MASK;
+  while (hindex[i].slot != HINDEX_EMPTY && hindex[i].slot != slot) i = (i + 1) & HINDEX_MASK;
+  hindex[i].prefix = prefix;
+  hindex[i].slot = slot;
+}
+
+/* Backward-shift deletion, keeps probe chains intact without tombstones */
+static void hindex_remove(const uint8_t *hash, uint16_t slot) {
+  uint32_t i = hash_prefix(hash) & HINDEX_MASK;
+  while (hindex[i].slot != slot) {
+    if (hindex[i].slot == HINDEX_EMPTY) return; /* not indexed */
+    i = (i + 1) & HINDEX_MASK;
+  }
+  uint32_t j = i;
+  while (1) {
+    j = (j + 1) & HINDEX_MASK;
+    if (hindex[j].slot == HINDEX_EMPTY) break;
+    uint32_t home = hindex[j].prefix & HINDEX_MASK;
+    /* entry at j may move into the hole only if its home is not within (i, j] */
+    if (((j - home) & HINDEX_MASK) < ((j - i) & HINDEX_MASK)) continue;
+    hindex[i] = hindex[j];
+    i = j;
+  }
+  hindex[i].slot = HINDEX_EMPTY;
+}
+
+/**
+ * Sectors are the unit of recycling.
+ * Binary min-heaps over sectors, pos[] tracks each sector's
+ * position for O(log n) updates:
+ * evict_heap: used sectors, most shared first then oldest newest-block date.
+ * worn_heap: used sectors, least erased first, see recycle_candidate().
+ * erased_heap: erased sectors, least erased first, see find_empty_slot().
+ */
+enum sector_state {
+  SECTOR_ERASED = 0,
+  SECTOR_UNVERIFIED, /* read as erased during boot, erase may have been cut short */
+  SECTOR_OPEN, /* has SECTOR_GLYPH, holds records */
+  SECTOR_DIRTY /* unknown contents, must be erased before use */
+};
+
+struct sector_info {
+  uint8_t state;
+  uint8_t free; /* unclaimed trailing pages */
+  uint8_t shares; /* least shared record */
+  uint64_t date; /* newest record */
+};
+static struct sector_info sectors[N_SECTORS];
+static uint32_t erase_counts[WEAR_SECTORS];
+
+struct __attribute__((packed)) slot_info {
+  uint64_t date; /* block date */
+  uint8_t shares; /* decay, N-times given to peers */
+  uint8_t pages; /* record length, 0: no record starts here */
+};
+static struct slot_info slots[N_SLOTS];
+
+struct sector_heap {
+  uint16_t items[N_SECTORS];
+  int16_t pos[N_SECTORS];
+  int size;
+  int (*before)(uint16_t a, uint16_t b);
+};
+
+static int evict_before(uint16_t a, uint16_t b) {
+  if (sectors[a].shares != sectors[b].shares) return sectors[a].shares > sectors[b].shares;
+  return sectors[a].date < sectors[b].date;
+}
+
+/* Ties go to the lower sector, erasing bumps the count so equally worn sectors take turns */
+static int less_worn(uint16_t a, uint16_t b) {
+  if (erase_counts[a] != erase_counts[b]) return erase_counts[a] < erase_counts[b];
+  return a < b;
+}
+
+static struct sector_heap evict_heap = { .before = evict_before };
+static struct sector_heap worn_heap = { .before = less_worn };
+static struct sector_heap erased_heap = { .before = less_worn };
+
+static void heap_swap(struct sector_heap *h, int i, int j) {
+  uint16_t tmp = h->items[i];
+  h->items[i] = h->items[j];
+  h->items[j] = tmp;
+  h->pos[h->items[i]] = i;
+  h->pos[h->items[j]] = j;
+}
+
+static void heap_sift_up(struct sector_heap *h, int i) {
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (!h->before(h->items[i], h->items[parent])) break;
+    heap_swap(h, i, parent);
+    i = parent;
+  }
+}
+
+static void heap_sift_down(struct sector_heap *h, int i) {
+  while (1) {
+    int min = i, l = 2 * i + 1, r = 2 * i + 2;
+    if (l < h->size && h->before(h->items[l], h->items[min])) min = l;
+    if (r < h->size && h->before(h->items[r], h->items[min])) min = r;
+    if (min == i) break;
+    heap_swap(h, i, min);
+    i = min;
+  }
+}
+
+static void heap_clear(struct sector_heap *h) {
+  h->size = 0;
+  memset(h->pos, 0xff, sizeof(h->pos));
+}
+
+static void heap_push(struct sector_heap *h, uint16_t sector) {
+  h->items[h->size] = sector;
+  h->pos[sector] = h->size;
+  heap_sift_up(h, h->size++);
+}
+
+static void heap_remove(struct sector_heap *h, uint16_t sector) {
+  int i = h->pos[sector];
+  if (i < 0) return;
+  h->pos[sector] = -1;
+  if (i == --h->size) return;
+  uint16_t moved = h->items[h->size];
+  h->items[i] = moved;
+  h->pos[moved] = i;
+  heap_sift_up(h, i);
+  heap_sift_down(h, h->pos[moved]);
+}
+
+/* Call after sector's keys changed, pushes it when not in h */
+static void heap_update(struct sector_heap *h, uint16_t sector) {
+  int i = h->pos[sector];
+  if (i < 0) {
+    heap_push(h, sector);
+    return;
+  }
+  heap_sift_up(h, i);
+  heap_sift_down(h, h->pos[sector]);
+}
+
+/* Used sectors are tracked by eviction order and wear */
+static void used_update(uint16_t sector) {
+  heap_update(&evict_heap, sector);
+  heap_update(&worn_heap, sector);
+}
+
+static void used_remove(uint16_t sector) {
+  heap_remove(&evict_heap, sector);
+  heap_remove(&worn_heap, sector);
+}
+
+/**
+ * Author index, author-prefix => chain of slot-ids linked through anext[].
+ * Authors sharing a prefix share a chain, iteration compares the full key.
+ * Once the table is full further authors share an overflow chain.
+ */
+#define AINDEX_SIZE 2048
+#define AINDEX_MASK (AINDEX_SIZE - 1)
+#define AINDEX_MAX (AINDEX_SIZE * 3 / 4)
+#define SLOT_NONE UINT16_MAX
+
+struct aindex_entry {
+  uint32_t prefix; /* first 4 bytes of author key */
+  uint16_t head; /* newest slot of chain, SLOT_NONE: unused entry */
+  uint16_t count;
+};
+static struct aindex_entry aindex[AINDEX_SIZE];
+static int aindex_used = 0;
+static uint16_t anext[N_SLOTS];
+static uint16_t aoverflow = SLOT_NONE;
+
+static void aindex_clear(void) {
+  for (int i = 0; i < AINDEX_SIZE; i++) aindex[i].head = SLOT_NONE;
+  aindex_used = 0;
+  aoverflow = SLOT_NONE;
+}
+
+/* Entry holding author-prefix or -1 */
+static int aindex_find(uint32_t prefix) {
+  for (uint32_t i = prefix & AINDEX_MASK; aindex[i].head != SLOT_NONE; i = (i + 1) & AINDEX_MASK) {
+    if (aindex[i].prefix == prefix) return i;
+  }
+  return -1;
+}
+
+static void aindex_insert(const uint8_t *author, uint16_t slot) {
+  uint32_t prefix = hash_prefix(author);
+  int e = aindex_find(prefix);
+  if (e < 0 && aindex_used == AINDEX_MAX) {
+    anext[slot] = aoverflow;
+    aoverflow = slot;
+    return;
+  }
+  if (e < 0) {
+    e = prefix & AINDEX_MASK;
+    while (aindex[e].head != SLOT_NONE) e = (e + 1) & AINDEX_MASK;
+    aindex[e].prefix = prefix;
+    aindex[e].count = 0;
+    aindex_used++;
+  }
+  anext[slot] = aindex[e].head;
+  aindex[e].head = slot;
+  aindex[e].count++;
+}
+
+/* Unlinks slot from chain, 1 when found */
+static int chain_unlink(uint16_t *head, uint16_t slot) {
+  for (uint16_t *p = head; *p != SLOT_NONE; p = &anext[*p]) {
+    if (*p != slot) continue;
+    *p = anext[slot];
+    return 1;
+  }
+  return 0;
+}
+
+static void aindex_remove(const uint8_t *author, uint16_t slot) {
+  int e = aindex_find(hash_prefix(author));
+  if (e < 0 || !chain_unlink(&aindex[e].head, slot)) {
+    chain_unlink(&aoverflow, slot);
+    return;
+  }
+  if (--aindex[e].count) return;
+  /* Last of chain, backward-shift like hindex_remove() */
+  uint32_t i = e, j = e;
+  while (1) {
+    j = (j + 1) & AINDEX_MASK;
+    if (aindex[j].head == SLOT_NONE) break;
+    uint32_t home = aindex[j].prefix & AINDEX_MASK;
+    if (((j - home) & AINDEX_MASK) < ((j - i) & AINDEX_MASK)) continue;
+    aindex[i] = aindex[j];
+    i = j;
+  }
+  aindex[i].head = SLOT_NONE;
+  aindex_used--;
+}
 
-static esp_err_t pr_get_slot (flash_slot_t *dst, uint16_t idx) {
+/**
+ * Time index, slot-ids of all records ordered by block date,
+ * ties by slot-id. Dates are read from slots[] so entries
+ * must be removed before a slot is cleared.
+ */
+static uint16_t tindex[N_SLOTS];
+static int tindex_size = 0;
+
+/* First position with key >= (date, slot) */
+static int tindex_lower_bound(uint64_t date, int slot) {
+  int lo = 0, hi = tindex_size;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    uint16_t s = tindex[mid];
+    if (slots[s].date < date || (slots[s].date == date && s < slot)) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+static void tindex_insert(uint16_t slot) {
+  int i = tindex_lower_bound(slots[slot].date, slot);
+  memmove(&tindex[i + 1], &tindex[i], (tindex_size - i) * sizeof(uint16_t));
+  tindex[i] = slot;
+  tindex_size++;
+}
+
+static void tindex_remove(uint16_t slot) {
+  int i = tindex_lower_bound(slots[slot].date, slot);
+  if (i == tindex_size || tindex[i] != slot) return; /* not indexed */
+  memmove(&tindex[i], &tindex[i + 1], (tindex_size - i - 1) * sizeof(uint16_t));
+  tindex_size--;
+}
+
+static int tindex_cmp(const void *a, const void *b) {
+  uint16_t x = *(const uint16_t*)a, y = *(const uint16_t*)b;
+  if (slots[x].date != slots[y].date) return slots[x].date < slots[y].date ? -1 : 1;
+  return (int)x - (int)y;
+}
+
+/* Recomputes sector eviction keys from its records */
+static void sector_refresh(uint16_t sector) {
+  struct sector_info *info = &sectors[sector];
+  info->shares = UINT8_MAX; /* no records, garbage goes first */
+  info->date = 0;
+  for (int s = sector * PAGES_PER_SECTOR; s < (sector + 1) * PAGES_PER_SECTOR; s++) {
+    if (!slots[s].pages) continue;
+    if (slots[s].shares < info->shares) info->shares = slots[s].shares;
+    if (slots[s].date > info->date) info->date = slots[s].date;
+  }
+  used_update(sector);
+}
+
+static void sectors_clear(void) {
+  memset(slots, 0, sizeof(slots));
+  heap_clear(&evict_heap);
+  heap_clear(&worn_heap);
+  heap_clear(&erased_heap);
+  for (int i = 0; i < N_SECTORS; i++) {
+    sectors[i].state = SECTOR_ERASED;
+    sectors[i].free = PAGES_PER_SECTOR;
+    heap_push(&erased_heap, i);
+  }
+  tindex_size = 0;
+  state.open = -1;
+}
+
+static const struct sector_header *get_sector_header (uint16_t sector) {
+  if (state.mmap_ptr != NULL) return (const struct sector_header*)(state.mmap_ptr + SECTOR_OFFSET(sector));
+  if (state.hdr_cached != sector) {
+    ESP_ERROR_CHECK(flash_read(SECTOR_OFFSET(sector), &state.hdr_cache, sizeof(struct sector_header)));
+    state.hdr_cached = sector;
+  }
+  return &state.hdr_cache;
+}
+
+static int is_record_head (uint16_t idx) {
+  const struct sector_header *hdr = get_sector_header(SLOT_SECTOR(idx));
+  return hdr->glyph == SECTOR_GLYPH && hdr->pages[SLOT_PAGE(idx)] == PAGE_HEAD && hdr->commit[SLOT_PAGE(idx)] == PAGE_COMMIT;
+}
+
+/**
+ * @brief Returns slot pointing straight into mapped flash,
+ * copies `size` bytes into dst only when unmapped.
+ */
+static const flash_slot_t *pr_get_slot (flash_slot_t *dst, uint16_t idx, size_t size) {
   // ESP_LOGI(TAG, "pr_get_slot(%p, %i)", dst, idx);
-  return esp_partition_read(partition, SLOT_OFFSET(idx), dst, SLOT_SIZE);
+  if (state.mmap_ptr != NULL) return (const flash_slot_t*)(state.mmap_ptr + SLOT_OFFSET(idx));
+  ESP_ERROR_CHECK(flash_read(SLOT_OFFSET(idx), dst, size));
+  return dst;
+}
+
+/* Exact index lookup, prefix collisions cost a header read */
+static int hindex_find(const uint8_t *hash) {
+  flash_slot_t tmp;
+  uint32_t prefix = hash_prefix(hash);
+  for (uint32_t i = prefix & HINDEX_MASK; hindex[i].slot != HINDEX_EMPTY; i = (i + 1) & HINDEX_MASK) {
+    if (hindex[i].prefix != prefix) continue;
+    if (0 == memcmp(pr_get_slot(&tmp, hindex[i].slot, sizeof(flash_slot_t))->hash, hash, 32)) return hindex[i].slot;
+  }
+  return -1;
 }
 
 /**
- * @brief Iteraters through ring buffer
- * @return 0: not done, -1: done, empty space reached, 1: done, starting offset reached.
+ * Sync index, slot-ids of records with hops < PR_MAX_HOPS
+ * ordered by (date, hash) as negentropy expects.
+ * One sorted array cut into chunks, each chunk carries the sum
+ * of its hashes so range fingerprints only read the records at
+ * the edges. Chunks split when full and merge with a neighbour
+ * when both fit into one. Dates come from slots[], so entries
+ * must be removed before a slot is cleared, like tindex.
  */
-int pr_iter_next(pr_iterator_t *iter) {
-  iter->block = NULL;
-  int first_run = iter->offset == 0;
-  uint16_t idx = iter->start + iter->offset;
-  iter->offset++;
-  if (first_run) iter->_tmp = calloc(1, SLOT_SIZE);
-  else memset(iter->_tmp, 0, SLOT_SIZE);
+#define SYNC_CHUNK 64 /* slot-ids per chunk */
+#define SYNC_CHUNKS (2 * N_SLOTS / SYNC_CHUNK + 4) /* neighbours hold > SYNC_CHUNK once packed */
+
+struct sync_chunk {
+  uint16_t n;
+  uint8_t sum[32]; /* see sum_add() */
+  uint16_t slots[SYNC_CHUNK];
+};
+#define SYNC_RECORD(n) (offsetof(struct sync_chunk, slots) + (n) * sizeof(uint16_t)) /* bytes on checkpoint */
+_Static_assert(CKPT_SYNC_OFFSET(0, N_SLOTS) + SYNC_CHUNKS * SYNC_RECORD(0) + N_SLOTS * sizeof(uint16_t) <= CKPT_OFFSET(1), "checkpoint overflows");
 
-  if (!first_run && SLOT_OFFSET(idx) == SLOT_OFFSET(iter->start)) return 1; /* Wrap around completed */
+static struct sync_chunk schunks[SYNC_CHUNKS];
+static int sync_chunks = 0;
+static int sync_size = 0;
 
-  ESP_ERROR_CHECK(pr_get_slot(iter->_tmp, idx));
-  flash_slot_t *slot = iter->_tmp;
+/* 256-bit little endian addition, same as negentropy's Accumulator */
+static void sum_add(uint8_t *sum, const uint8_t *hash) {
+  unsigned carry = 0;
+  for (int i = 0; i < 32; i++) {
+    carry += sum[i] + hash[i];
+    sum[i] = carry & 0xff;
+    carry >>= 8;
+  }
+}
+
+static void sum_sub(uint8_t *sum, const uint8_t *hash) {
+  int borrow = 0;
+  for (int i = 0; i < 32; i++) {
+    int d = sum[i] - hash[i] - borrow;
+    borrow = d < 0;
+    sum[i] = d & 0xff;
+  }
+}
+
+static const uint8_t *slot_hash(flash_slot_t *tmp, uint16_t slot) {
+  return pr_get_slot(tmp, slot, offsetof(flash_slot_t, block))->hash;
+}
+
+/* Order of slot against key (date, hash), hashes are only read on equal dates */
+static int sync_cmp(uint16_t slot, uint64_t date, const uint8_t *hash) {
+  if (slots[slot].date != date) return slots[slot].date < date ? -1 : 1;
+  flash_slot_t tmp;
+  return memcmp(slot_hash(&tmp, slot), hash, 32);
+}
+
+static void sync_clear(void) {
+  sync_chunks = 0;
+  sync_size = 0;
+}
+
+/* Chunk that holds or would hold key, offset is set to its lower bound within */
+static int sync_locate(uint64_t date, const uint8_t *hash, int *offset) {
+  int c = 0;
+  while (c < sync_chunks - 1 && sync_cmp(schunks[c].slots[schunks[c].n - 1], date, hash) < 0) c++;
+  int lo = 0, hi = sync_chunks ? schunks[c].n : 0;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (sync_cmp(schunks[c].slots[mid], date, hash) < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  *offset = lo;
+  return c;
+}
+
+/* Chunk holding position, pos becomes offset within */
+static int sync_seek(size_t *pos) {
+  int c = 0;
+  while (c < sync_chunks && *pos >= schunks[c].n) *pos -= schunks[c++].n;
+  return c;
+}
+
+static void sync_drop(int c) {
+  memmove(&schunks[c], &schunks[c + 1], (sync_chunks - c - 1) * sizeof(struct sync_chunk));
+  sync_chunks--;
+}
+
+/* Appends chunk c + 1 to c */
+static void sync_merge(int c) {
+  struct sync_chunk *a = &schunks[c], *b = &schunks[c + 1];
+  memcpy(&a->slots[a->n], b->slots, b->n * sizeof(uint16_t));
+  a->n += b->n;
+  sum_add(a->sum, b->sum);
+  sync_drop(c + 1);
+}
 
-  if (slot->glyph != SLOT_GLYPH) return -1; /* End of memory reached */
+/* Merges all neighbours that fit, sums add up so nothing is read */
+static void sync_pack(void) {
+  int c = 0;
+  while (c < sync_chunks - 1) {
+    if (schunks[c].n + schunks[c + 1].n <= SYNC_CHUNK) sync_merge(c);
+    else c++;
+  }
+}
+
+/* Moves upper half of chunk c into a new chunk after it */
+static void sync_split(int c) {
+  memmove(&schunks[c + 2], &schunks[c + 1], (sync_chunks - c - 1) * sizeof(struct sync_chunk));
+  sync_chunks++;
+  struct sync_chunk *lo = &schunks[c], *hi = &schunks[c + 1];
+  hi->n = lo->n / 2;
+  lo->n -= hi->n;
+  memcpy(hi->slots, &lo->slots[lo->n], hi->n * sizeof(uint16_t));
+  memset(hi->sum, 0, sizeof(hi->sum));
+  flash_slot_t tmp;
+  for (int i = 0; i < hi->n; i++) sum_add(hi->sum, slot_hash(&tmp, hi->slots[i]));
+  sum_sub(lo->sum, hi->sum);
+}
+
+static void sync_insert(uint16_t slot, const uint8_t *hash) {
+  if (!sync_chunks) {
+    schunks[0].n = 0;
+    memset(schunks[0].sum, 0, sizeof(schunks[0].sum));
+    sync_chunks = 1;
+  }
+  int i, c = sync_locate(slots[slot].date, hash, &i);
+  if (schunks[c].n == SYNC_CHUNK) {
+    if (sync_chunks == SYNC_CHUNKS) {
+      sync_pack();
+      c = sync_locate(slots[slot].date, hash, &i);
+    }
+    if (schunks[c].n == SYNC_CHUNK) {
+      sync_split(c);
+      if (i > schunks[c].n) i -= schunks[c++].n;
+    }
+  }
+  struct sync_chunk *ch = &schunks[c];
+  memmove(&ch->slots[i + 1], &ch->slots[i], (ch->n - i) * sizeof(uint16_t));
+  ch->slots[i] = slot;
+  ch->n++;
+  sum_add(ch->sum, hash);
+  sync_size++;
+}
+
+static void sync_remove(uint16_t slot, const uint8_t *hash) {
+  if (!sync_size) return;
+  int i, c = sync_locate(slots[slot].date, hash, &i);
+  struct sync_chunk *ch = &schunks[c];
+  if (i == ch->n || ch->slots[i] != slot) return; /* not indexed */
+  memmove(&ch->slots[i], &ch->slots[i + 1], (ch->n - i - 1) * sizeof(uint16_t));
+  ch->n--;
+  sum_sub(ch->sum, hash);
+  sync_size--;
+  if (!ch->n) sync_drop(c);
+  else if (c + 1 < sync_chunks && ch->n + schunks[c + 1].n <= SYNC_CHUNK) sync_merge(c);
+  else if (c > 0 && ch->n + schunks[c - 1].n <= SYNC_CHUNK) sync_merge(c - 1);
+}
+
+/* Points iterator at record header, 0 unless slot is empty or deleted */
+static int position_iter(pr_iterator_t *iter, const flash_slot_t *slot) {
+  if (slot->glyph != SLOT_GLYPH) return -1;
+  if (~slot->iflags & FLAG_TOMB) return -1; /* deleted */
   iter->meta.flags = ~slot->iflags;
-  iter->meta.decay = __builtin_clzll(slot->decay);
+  iter->meta.decay = slot->decay ? __builtin_clzll(slot->decay) : 64;
   iter->meta.stored_at = slot->stored_at;
   iter->meta.hops = slot->hops;
   iter->meta.hash = slot->hash;
@@ -76,146 +743,1225 @@ int pr_iter_next(pr_iterator_t *iter) {
   return 0;
 }
 
-/* To be removed when mmap works. */
+/**
+ * Block cache, recently written & served blocks kept in RAM
+ * (PSRAM when present) so relaying a fresh block to several peers
+ * reads flash at most once. Budget is taken from free heap at boot,
+ * least recently used entries go first. Guarded by REPO_LOCK.
+ */
+#define CACHE_MAX_ENTRIES 128
+#define CACHE_HEAP_SHARE 16 /* budget = free heap / share */
+#define CACHE_MAX_BYTES (256 * 1024)
+#define CACHE_HOST_BYTES (128 * 1024)
+
+struct cache_entry {
+  uint8_t hash[32];
+  int slot; /* flash or cold slot-id, -1: unused */
+  uint8_t hops;
+  uint8_t shares; /* when cached, cold records only */
+  uint32_t last_use;
+  size_t size;
+  uint8_t *block;
+};
+
+static struct {
+  struct cache_entry entries[CACHE_MAX_ENTRIES];
+  size_t budget, used;
+  uint32_t clock;
+  uint32_t caps; /* heap to allocate from */
+  uint32_t hits, misses;
+} cache;
+
+static void cache_init(void) {
+  for (int i = 0; i < CACHE_MAX_ENTRIES; i++) cache.entries[i].slot = -1;
+#if CONFIG_IDF_TARGET_LINUX
+  cache.budget = CACHE_HOST_BYTES;
+#else
+  size_t free_psram = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+  cache.caps = free_psram ? MALLOC_CAP_SPIRAM : MALLOC_CAP_8BIT;
+  cache.budget = (free_psram ? free_psram : heap_caps_get_free_size(MALLOC_CAP_8BIT)) / CACHE_HEAP_SHARE;
+  if (cache.budget > CACHE_MAX_BYTES) cache.budget = CACHE_MAX_BYTES;
+#endif
+}
+
+static int cache_find(const uint8_t *hash) {
+  for (int i = 0; i < CACHE_MAX_ENTRIES; i++) {
+    if (cache.entries[i].slot != -1 && 0 == memcmp(cache.entries[i].hash, hash, 32)) return i;
+  }
+  return -1;
+}
+
+static void cache_drop(int i) {
+  free(cache.entries[i].block);
+  cache.used -= cache.entries[i].size;
+  cache.entries[i].slot = -1;
+}
+
+/* Forgets block, call before its slot is reused */
+static void cache_remove(const uint8_t *hash) {
+  int i = cache_find(hash);
+  if (i >= 0) cache_drop(i);
+}
+
+static void cache_clear(void) {
+  for (int i = 0; i < CACHE_MAX_ENTRIES; i++) {
+    if (cache.entries[i].slot != -1) cache_drop(i);
+  }
+}
+
+static void cache_put(const uint8_t *hash, const pf_block_t *block, uint8_t hops, uint8_t shares, int slot) {
+  const size_t size = pf_sizeof(block);
+  if (size > cache.budget || cache_find(hash) >= 0) return;
+  /* evict least recently used until entry & bytes fit */
+  while (1) {
+    int lru = -1, unused = -1;
+    for (int i = 0; i < CACHE_MAX_ENTRIES; i++) {
+      if (cache.entries[i].slot == -1) unused = i;
+      else if (lru == -1 || cache.entries[i].last_use < cache.entries[lru].last_use) lru = i;
+    }
+    if (unused != -1 && cache.used + size <= cache.budget) {
+#if CONFIG_IDF_TARGET_LINUX
+      uint8_t *copy = malloc(size);
+#else
+      uint8_t *copy = heap_caps_malloc(size, cache.caps);
+#endif
+      if (copy == NULL) return;
+      struct cache_entry *e = &cache.entries[unused];
+      memcpy(e->hash, hash, 32);
+      memcpy(copy, block, size);
+      e->block = copy;
+      e->size = size;
+      e->slot = slot;
+      e->hops = hops;
+      e->shares = shares;
+      e->last_use = ++cache.clock;
+      cache.used += size;
+      return;
+    }
+    cache_drop(lru);
+  }
+}
+
+/* Cold records keep shares in the entry, flash ones read slots[] */
+static void cache_set_shares(const uint8_t *hash, int slot, int shares) {
+  int i = cache_find(hash);
+  if (i < 0 || cache.entries[i].slot != slot) return;
+  if (shares < 0) cache_drop(i); /* no longer holds hash */
+  else cache.entries[i].shares = shares > UINT8_MAX ? UINT8_MAX : shares;
+}
+
+/* Positions iterator on a copy of the cached block, slot-id or -1 on miss */
+static int cache_load(pr_iterator_t *iter, const uint8_t *hash) {
+  int i = cache_find(hash);
+  if (i < 0) {
+    cache.misses++;
+    return -1;
+  }
+  cache.hits++;
+  struct cache_entry *e = &cache.entries[i];
+  e->last_use = ++cache.clock;
+  if (iter->_tmp == NULL) iter->_tmp = calloc(1, SLOT_SIZE);
+  iter->_tmp->hops = e->hops;
+  memcpy(iter->_tmp->hash, e->hash, 32);
+  memcpy(&iter->_tmp->block, e->block, e->size);
+  iter->slot = e->slot;
+  iter->meta.flags = 0;
+  iter->meta.decay = e->slot < N_SLOTS ? slots[e->slot].shares : e->shares;
+  iter->meta.stored_at = 0;
+  iter->meta.hops = e->hops;
+  iter->meta.hash = iter->_tmp->hash;
+  iter->block = &iter->_tmp->block;
+  iter->body_loaded = 1;
+  return e->slot;
+}
+
+/* Positions iterator on record at idx, 0 on success */
+static int load_slot(pr_iterator_t *iter, uint16_t idx) {
+  iter->block = NULL;
+  iter->body_loaded = 0;
+  iter->slot = idx;
+  if (state.mmap_ptr == NULL) { /* unmapped, copy slots into temporary buffer */
+    if (iter->_tmp == NULL) iter->_tmp = calloc(1, SLOT_SIZE);
+    else if (iter->mode != PR_ITER_HEADERS) memset(iter->_tmp, 0, SLOT_SIZE);
+  }
+  const flash_slot_t *slot = pr_get_slot(iter->_tmp, idx, sizeof(flash_slot_t));
+  if (0 != position_iter(iter, slot)) return -1;
+  iter->body_loaded = state.mmap_ptr != NULL;
+  if (iter->mode != PR_ITER_HEADERS && NULL == pr_iter_load_body(iter)) return -1;
+  return 0;
+}
+
+/**
+ * @brief Iteraters through ring buffer
+ * @return 0: not done, 1: done, starting offset reached.
+ */
+int pr_iter_next(pr_iterator_t *iter) {
+  iter->block = NULL;
+  REPO_LOCK(); /* keeps the evictor off the slot while it is read */
+  while (iter->offset < N_SLOTS) {
+    uint16_t idx = (iter->start + iter->offset++) % N_SLOTS;
+    if (!is_record_head(idx)) continue;
+    if (0 != load_slot(iter, idx)) continue;
+    REPO_UNLOCK();
+    return 0;
+  }
+  REPO_UNLOCK();
+  return 1; /* Wrap around completed */
+}
+
+const pf_block_t *pr_iter_load_body(pr_iterator_t *iter) {
+  if (iter->block == NULL) return NULL;
+  if (iter->body_loaded) return iter->block;
+  if (iter->slot >= PR_COLD_SLOT) {
+    store_meta_t meta;
+    if (0 > store_read_block(iter->slot - PR_COLD_SLOT, (uint8_t*)&iter->_tmp->block, SLOT_SIZE - RECORD_SIZE(0), &meta)) return NULL;
+    /* evicted and reused since the headers were read */
+    if (0 != memcmp(meta.hash, iter->_tmp->hash, 32)) {
+      iter->block = NULL;
+      return NULL;
+    }
+    iter->body_loaded = 1;
+    return iter->block;
+  }
+  size_t block_size = pf_sizeof(iter->block);
+  /* garbage header, record would overflow sector */
+  if (SLOT_PAGE(iter->slot) * PAGE_BYTES + RECORD_SIZE(block_size) > SLOT_SIZE) return NULL;
+  size_t remain = block_size - sizeof(pf_block_t);
+  REPO_LOCK();
+  ESP_ERROR_CHECK(flash_read(
+    SLOT_OFFSET(iter->slot) + sizeof(flash_slot_t),
+    (uint8_t*)iter->_tmp + sizeof(flash_slot_t),
+    remain
+  ));
+  REPO_UNLOCK();
+  iter->body_loaded = 1;
+  return iter->block;
+}
+
+/**
+ * Positions iterator on cold record, the block is copied into _tmp
+ * so it looks like any other slot. Headers mode reads a single sector.
+ */
+static int load_cold(pr_iterator_t *iter, uint32_t record) {
+  iter->block = NULL;
+  iter->body_loaded = 0;
+  iter->slot = PR_COLD_SLOT + record;
+  if (iter->_tmp == NULL) iter->_tmp = calloc(1, SLOT_SIZE);
+  const size_t max = iter->mode == PR_ITER_HEADERS ? sizeof(pf_block_t) : SLOT_SIZE - RECORD_SIZE(0);
+  store_meta_t meta;
+  int size = store_read_block(record, (uint8_t*)&iter->_tmp->block, max, &meta);
+  if (size < 0 || RECORD_SIZE(size) > SLOT_SIZE) return -1;
+  iter->_tmp->hops = meta.hops;
+  memcpy(iter->_tmp->hash, meta.hash, 32);
+  iter->meta.flags = 0;
+  iter->meta.decay = meta.shares;
+  iter->meta.stored_at = 0;
+  iter->meta.hops = meta.hops;
+  iter->meta.hash = iter->_tmp->hash;
+  iter->block = &iter->_tmp->block;
+  iter->body_loaded = (size_t)size <= max;
+  return 0;
+}
+
+int pr_iter_cold(pr_iterator_t *iter) {
+  iter->block = NULL;
+  if (!state.cold) return 1;
+  uint32_t cursor = iter->offset;
+  int record;
+  while ((record = store_iter_next(&cursor))) {
+    iter->offset = cursor;
+    if (0 != load_cold(iter, record)) continue;
+    /* migration cut short, flash copy wins */
+    REPO_LOCK();
+    int hot = hindex_find(iter->meta.hash) >= 0;
+    REPO_UNLOCK();
+    if (!hot) return 0;
+  }
+  iter->offset = cursor;
+  return 1;
+}
+
+/* _tmp is only allocated when flash is unmapped or cold records were loaded. */
 void pr_iter_deinit(pr_iterator_t *iter) {
   free(iter->_tmp);
   memset(iter, 0, sizeof(pr_iterator_t));
 }
 
 /**
- * @brief Finds a writable slot.
- * failing to find an empty slot then next
- * slot in line for recycling is returned.
+ * Sequential scan, a reader task streams whole sectors into a ring
+ * of buffers while the caller works through the records of the
+ * current one. Buffers travel between two queues:
+ * free => reader fills => full => caller drains => free
+ * A buffer with sector -1 marks the end. Mapped or not, sectors
+ * are copied under REPO_LOCK, so records stay intact even when
+ * the sector is recycled while the caller still works on it.
  */
-static int find_empty_slot () {
-  pr_iterator_t iter = {0};
-  /* registers for our garbage collection */
-  int most_decayed_idx = -1;
-  uint8_t most_decayed_value = UINT8_MAX;
-  int oldest_block = -1;
-  uint64_t oldest_date = UINT64_MAX;
-
-  int exit = 0;
-  while (0 == (exit = pr_iter_next(&iter))) {
-    if (iter.meta.decay < most_decayed_value) {
-      most_decayed_value = iter.meta.decay;
-      /* not sure if doing iterators right but raw offset points to next block, not current */
-      most_decayed_idx = iter.offset - 1;
-    }
-
-    if (iter.meta.decay != 0) { // 0 is synonymous with entombed
-      assert(CANONICAL == pf_typeof(iter.block));
-      uint64_t date = pf_read_utc(iter.block->net.date);
-      if (date < oldest_date) {
-	oldest_date = date;
-	oldest_block = iter.offset - 1;
-      }
+struct scan_buf {
+  int sector;
+  uint8_t data[SECTOR_SIZE];
+};
+
+struct pr_scan {
+  const uint8_t *skip; /* sectors to leave out, may be NULL */
+  int depth;
+  int next; /* next sector to read */
+  volatile int stop;
+  QueueHandle_t free_q, full_q;
+  struct scan_buf *bufs;
+  struct scan_buf *cur; /* held by caller, NULL before first */
+  int sync; /* no reader task, caller reads into bufs[0] */
+  const uint8_t *data; /* of current sector, a copy */
+  int sector, page;
+  int done;
+};
+
+/* Next sector worth reading or -1 */
+static int scan_advance(pr_scan_t *scan) {
+  while (scan->next < N_SECTORS) {
+    int n = scan->next++;
+    if (sectors[n].state != SECTOR_OPEN) continue; /* no records */
+    if (scan->skip == NULL || !scan->skip[n]) return n;
+  }
+  return -1;
+}
+
+/* Copies next sector into buf, sector -1 when done */
+static void scan_fill(pr_scan_t *scan, struct scan_buf *buf) {
+  REPO_LOCK(); /* no erase halfway through */
+  buf->sector = scan->stop ? -1 : scan_advance(scan);
+  if (buf->sector != -1) ESP_ERROR_CHECK(flash_read(SECTOR_OFFSET(buf->sector), buf->data, SECTOR_SIZE));
+  REPO_UNLOCK();
+}
+
+static void scan_reader(void *arg) {
+  pr_scan_t *scan = arg;
+  struct scan_buf *buf;
+  int sector;
+  do { /* buf and scan belong to the caller once sent */
+    xQueueReceive(scan->free_q, &buf, portMAX_DELAY);
+    scan_fill(scan, buf);
+    sector = buf->sector;
+    xQueueSend(scan->full_q, &buf, portMAX_DELAY);
+  } while (sector != -1);
+  vTaskDelete(NULL);
+}
+
+static pr_scan_t *scan_open(int depth, const uint8_t *skip) {
+  pr_scan_t *scan = calloc(1, sizeof(pr_scan_t));
+  scan->skip = skip;
+  scan->sector = -1;
+  scan->page = PAGES_PER_SECTOR;
+  scan->depth = depth < 2 ? 2 : depth;
+  scan->bufs = malloc(scan->depth * sizeof(struct scan_buf));
+  scan->free_q = xQueueCreate(scan->depth, sizeof(struct scan_buf*));
+  scan->full_q = xQueueCreate(scan->depth, sizeof(struct scan_buf*));
+  for (int i = 0; i < scan->depth; i++) {
+    struct scan_buf *buf = &scan->bufs[i];
+    xQueueSend(scan->free_q, &buf, 0);
+  }
+  if (pdPASS != xTaskCreate(scan_reader, "repo_scan", 2048, scan, tskIDLE_PRIORITY + 2, NULL)) {
+    ESP_LOGW(TAG, "No reader task, scanning without read-ahead");
+    scan->sync = 1;
+  }
+  return scan;
+}
+
+pr_scan_t *pr_scan_open(int depth) {
+  return scan_open(depth, NULL);
+}
+
+/* Moves on to the next sector, 0 when there is none */
+static int scan_next_sector(pr_scan_t *scan) {
+  if (scan->done) return 0;
+  scan->page = 0;
+  if (scan->sync) {
+    scan_fill(scan, &scan->bufs[0]);
+    scan->sector = scan->bufs[0].sector;
+    scan->data = scan->bufs[0].data;
+  } else {
+    if (scan->cur != NULL) xQueueSend(scan->free_q, &scan->cur, portMAX_DELAY);
+    xQueueReceive(scan->full_q, &scan->cur, portMAX_DELAY);
+    scan->sector = scan->cur->sector;
+    scan->data = scan->cur->data;
+  }
+  scan->done = scan->sector == -1;
+  return !scan->done;
+}
+
+int pr_scan_next(pr_scan_t *scan, pr_iterator_t *iter) {
+  iter->block = NULL;
+  while (1) {
+    if (scan->page == PAGES_PER_SECTOR && !scan_next_sector(scan)) return 1;
+    const struct sector_header *hdr = (const struct sector_header*)scan->data;
+    const int page = scan->page++;
+    if (hdr->glyph != SECTOR_GLYPH || hdr->pages[page] != PAGE_HEAD || hdr->commit[page] != PAGE_COMMIT) continue;
+    const flash_slot_t *slot = (const flash_slot_t*)(scan->data + SECTOR_HEADER_SIZE + page * PAGE_BYTES);
+    if (0 != position_iter(iter, slot)) continue;
+    /* garbage header, record would overflow sector */
+    if (page * PAGE_BYTES + RECORD_SIZE(pf_sizeof(&slot->block)) > SLOT_SIZE) continue;
+    iter->slot = scan->sector * PAGES_PER_SECTOR + page;
+    iter->body_loaded = 1;
+    return 0;
+  }
+}
+
+void pr_scan_close(pr_scan_t *scan) {
+  /* drain until the reader signs off */
+  scan->stop = 1;
+  while (!scan->sync && !scan->done) {
+    if (scan->cur != NULL) xQueueSend(scan->free_q, &scan->cur, portMAX_DELAY);
+    xQueueReceive(scan->full_q, &scan->cur, portMAX_DELAY);
+    scan->done = scan->cur->sector == -1;
+  }
+  vQueueDelete(scan->free_q);
+  vQueueDelete(scan->full_q);
+  free(scan->bufs);
+  free(scan);
+}
+
+/* Writes counters to the inactive meta sector and makes it active */
+static void wear_snapshot(void) {
+  int next = state.wear_meta == 0 ? 1 : 0;
+  ESP_ERROR_CHECK(flash_erase(META_OFFSET(next), SECTOR_SIZE));
+  ESP_ERROR_CHECK(flash_write(META_OFFSET(next) + WEAR_COUNTS_OFFSET, erase_counts, sizeof(erase_counts)));
+  struct wear_meta hdr = { .glyph = WEAR_GLYPH, .generation = state.wear_generation + 1 };
+  ESP_ERROR_CHECK(flash_write(META_OFFSET(next), &hdr, sizeof(hdr)));
+  state.wear_meta = next;
+  state.wear_generation = hdr.generation;
+  state.wear_log = 0;
+}
+
+/* Loads snapshot and replays log, reads a single sector */
+static void wear_load(void) {
+  struct wear_meta hdr;
+  state.wear_meta = -1;
+  state.wear_generation = 0;
+  state.wear_log = 0;
+  memset(erase_counts, 0, sizeof(erase_counts));
+  for (int m = 0; m < META_SECTORS; m++) {
+    ESP_ERROR_CHECK(flash_read(META_OFFSET(m), &hdr, sizeof(hdr)));
+    if (hdr.glyph != WEAR_GLYPH) continue;
+    if (state.wear_meta == -1 || hdr.generation > state.wear_generation) {
+      state.wear_meta = m;
+      state.wear_generation = hdr.generation;
+    }
+  }
+  if (state.wear_meta == -1) { /* first boot, start counting */
+    wear_snapshot();
+    return;
+  }
+  ESP_ERROR_CHECK(flash_read(META_OFFSET(state.wear_meta) + WEAR_COUNTS_OFFSET, erase_counts, sizeof(erase_counts)));
+  uint16_t entry;
+  for (; state.wear_log < WEAR_LOG_SIZE; state.wear_log++) {
+    ESP_ERROR_CHECK(flash_read(META_OFFSET(state.wear_meta) + WEAR_LOG_OFFSET + state.wear_log * sizeof(uint16_t), &entry, sizeof(entry)));
+    if (entry == WEAR_LOG_EMPTY) break;
+    if (entry < WEAR_SECTORS) erase_counts[entry]++;
+  }
+}
+
+/* Counts an erase, appends to log or rolls over into a new snapshot */
+static void wear_count(uint16_t sector) {
+  erase_counts[sector]++;
+  if (state.wear_log == WEAR_LOG_SIZE) {
+    wear_snapshot();
+    return;
+  }
+  ESP_ERROR_CHECK(flash_write(META_OFFSET(state.wear_meta) + WEAR_LOG_OFFSET + state.wear_log * sizeof(uint16_t), &sector, sizeof(sector)));
+  state.wear_log++;
+}
+
+/* Copies live record to the cold tier, 0 when the card holds it */
+static int migrate_slot(uint16_t slot_idx) {
+  flash_slot_t *tmp = state.mmap_ptr == NULL ? malloc(SLOT_SIZE) : NULL;
+  const flash_slot_t *rec = pr_get_slot(tmp, slot_idx, slots[slot_idx].pages * PAGE_BYTES);
+  store_meta_t meta = { .hops = rec->hops, .shares = slots[slot_idx].shares, .date = slots[slot_idx].date };
+  memcpy(meta.hash, rec->hash, 32);
+  int res = store_import_block((const uint8_t*)&rec->block, &meta);
+  if (res < 0 && res != PR_ERROR_DUPLICATE) ESP_LOGW(TAG, "Migration of slot %i failed: %i", slot_idx, res);
+  free(tmp);
+  return res < 0 && res != PR_ERROR_DUPLICATE ? -1 : 0;
+}
+
+/* Drops all records in sector from indices and erases it,
+ * with a cold tier attached records are migrated first.
+ * Blocks that are gone for good are passed to evict_handler */
+static void evict_sector(uint16_t sector) {
+  flash_slot_t tmp;
+  for (int s = sector * PAGES_PER_SECTOR; s < (sector + 1) * PAGES_PER_SECTOR; s++) {
+    if (!slots[s].pages) continue;
+    const int kept = state.cold && 0 == migrate_slot(s);
+    const flash_slot_t *rec = pr_get_slot(&tmp, s, sizeof(flash_slot_t));
+    if (!kept && evict_handler != NULL) evict_handler(rec->hash);
+    cache_remove(rec->hash);
+    hindex_remove(rec->hash, s);
+    aindex_remove(rec->block.net.author, s);
+    tindex_remove(s);
+    sync_remove(s, rec->hash);
+    slots[s].pages = 0;
+  }
+  used_remove(sector);
+  state.ckpt_changes++;
+  ESP_LOGI(TAG, "erasing sector%i: %zu, +%i", sector, (size_t)SECTOR_OFFSET(sector), SECTOR_SIZE);
+  wear_count(sector); /* before the erase, power loss in between only costs a rescan */
+  ESP_ERROR_CHECK(flash_erase(SECTOR_OFFSET(sector), SECTOR_SIZE));
+  sectors[sector].state = SECTOR_ERASED;
+  sectors[sector].free = PAGES_PER_SECTOR;
+  heap_update(&erased_heap, sector); /* erase count went up */
+}
+
+/* Appending to a half erased sector would commit garbage */
+static int sector_is_blank(uint16_t sector) {
+  uint32_t buf[64];
+  for (size_t off = 0; off < SECTOR_SIZE; off += sizeof(buf)) {
+    ESP_ERROR_CHECK(flash_read(SECTOR_OFFSET(sector) + off, buf, sizeof(buf)));
+    for (int i = 0; i < 64; i++) if (buf[i] != UINT32_MAX) return 0;
+  }
+  return 1;
+}
+
+/**
+ * Next sector to recycle, heap order until it is worn WEAR_SLACK
+ * erases beyond the least worn sector in the heap, which is then
+ * taken instead so its (cold) blocks make room for hot ones.
+ * Otherwise a full device recycles the sector that shared blocks
+ * keep landing in over and over. O(1), both are heap tops.
+ */
+#define WEAR_SLACK 16
+static int recycle_candidate(void) {
+  if (evict_heap.size == 0) return -1;
+  const uint16_t next = evict_heap.items[0], least = worn_heap.items[0];
+  return erase_counts[next] > erase_counts[least] + WEAR_SLACK ? least : next;
+}
+
+/**
+ * @brief Finds a writable slot for record spanning n_pages.
+ * Appends to open sector when it fits, otherwise
+ * opens the least worn erased sector or recycles the next in line.
+ * O(1) flash access, sector states and heaps are rebuilt by pr_init()
+ */
+static int find_empty_slot (int n_pages) {
+  if (state.open >= 0 && sectors[state.open].free >= n_pages) {
+    return state.open * PAGES_PER_SECTOR + PAGES_PER_SECTOR - sectors[state.open].free;
+  }
+  /* least worn erased sector, heap top */
+  int sector = erased_heap.size ? erased_heap.items[0] : -1;
+  if (sector != -1 && sectors[sector].state == SECTOR_UNVERIFIED && !sector_is_blank(sector)) {
+    evict_sector(sector);
+  }
+  /* recycle most shared sector, then oldest, unless worn out */
+  if (sector == -1) {
+    sector = recycle_candidate();
+    assert(sector >= 0);
+    evict_sector(sector);
+  }
+  state.open = sector;
+  return sector * PAGES_PER_SECTOR;
+}
+
+/* Reserves pages for a record, directory is written on flush */
+static void reserve_pages(uint16_t slot_idx, int n_pages) {
+  uint16_t sector = SLOT_SECTOR(slot_idx);
+  used_remove(sector); /* not a recycling candidate until tracked again */
+  heap_remove(&erased_heap, sector);
+  sectors[sector].state = SECTOR_OPEN;
+  sectors[sector].free = PAGES_PER_SECTOR - SLOT_PAGE(slot_idx) - n_pages;
+}
+
+/* Registers written record with slot table & heaps */
+static void track_slot(uint16_t slot_idx, const pf_block_t *block, uint8_t shares) {
+  slots[slot_idx].date = pf_read_utc(block->net.date);
+  slots[slot_idx].shares = shares;
+  slots[slot_idx].pages = RECORD_PAGES(pf_sizeof(block));
+  sector_refresh(SLOT_SECTOR(slot_idx));
+}
+
+/**
+ * Flushes records of a batch that were placed in the same sector.
+ * Page directory is written once before the records,
+ * records are contiguous and written with a single call.
+ */
+static void flush_sector(pr_write_req_t *reqs, int from, int to, uint8_t *buffer) {
+  uint16_t sector = SLOT_SECTOR(reqs[from].result);
+  int first_page = SLOT_PAGE(reqs[from].result);
+  int end_page = first_page;
+  struct sector_header hdr;
+  memset(&hdr, 0xff, sizeof(hdr)); /* writing 1s leaves flash untouched */
+  hdr.glyph = SECTOR_GLYPH;
+  for (int r = from; r < to; r++) {
+    if (reqs[r].result < 0) continue;
+    int page = SLOT_PAGE(reqs[r].result);
+    int n_pages = RECORD_PAGES(pf_sizeof((const pf_block_t*)reqs[r].block_bytes));
+    for (int i = 0; i < n_pages; i++) hdr.pages[page + i] = i ? PAGE_TAIL : PAGE_HEAD;
+    end_page = page + n_pages;
+  }
+  ESP_ERROR_CHECK(flash_write(SECTOR_OFFSET(sector), &hdr, sizeof(hdr)));
+
+  const size_t size = (end_page - first_page) * PAGE_BYTES;
+  memset(buffer, 0xff, size);
+  for (int r = from; r < to; r++) {
+    if (reqs[r].result < 0) continue;
+    const size_t block_size = pf_sizeof((const pf_block_t*)reqs[r].block_bytes);
+    flash_slot_t *slot = (flash_slot_t*)(buffer + (SLOT_PAGE(reqs[r].result) - first_page) * PAGE_BYTES);
+    slot->glyph = SLOT_GLYPH;
+    slot->stored_at = time(NULL); // TODO: format is wrong
+    slot->hops = reqs[r].hops;
+    memcpy(slot->hash, reqs[r].hash, 32);
+    memcpy(&slot->block, reqs[r].block_bytes, block_size);
+  }
+  ESP_ERROR_CHECK(flash_write(SLOT_OFFSET(reqs[from].result), buffer, size));
+  /* Commit last, a record is not valid until this lands */
+  for (int r = from; r < to; r++) {
+    if (reqs[r].result >= 0) hdr.commit[SLOT_PAGE(reqs[r].result)] = PAGE_COMMIT;
+  }
+  ESP_ERROR_CHECK(flash_write(
+    SECTOR_OFFSET(sector) + offsetof(struct sector_header, commit) + first_page,
+    hdr.commit + first_page,
+    end_page - first_page
+  ));
+  ESP_LOGI(TAG, "Flashed %i blocks to sector %i, pages %i..%i", to - from, sector, first_page, end_page - 1);
+  state.ckpt_changes += to - from;
+
+  for (int r = from; r < to; r++) {
+    if (reqs[r].result < 0) continue;
+    const flash_slot_t *slot = (const flash_slot_t*)(buffer + (SLOT_PAGE(reqs[r].result) - first_page) * PAGE_BYTES);
+    hindex_insert(slot->hash, reqs[r].result);
+    cache_put(slot->hash, &slot->block, slot->hops, 0, reqs[r].result);
+    aindex_insert(slot->block.net.author, reqs[r].result);
+    track_slot(reqs[r].result, (const pf_block_t*)reqs[r].block_bytes, 0);
+    tindex_insert(reqs[r].result);
+    if (slot->hops < PR_MAX_HOPS) sync_insert(reqs[r].result, slot->hash);
+  }
+}
+
+/* Index is updated on flush, so check earlier requests of the same batch */
+static int batch_contains(const pr_write_req_t *reqs, int n) {
+  for (int r = 0; r < n; r++) {
+    if (reqs[r].result >= 0 && 0 == memcmp(reqs[r].hash, reqs[n].hash, 32)) return 1;
+  }
+  return 0;
+}
+
+int pr_write_blocks(pr_write_req_t *reqs, int n) {
+  REPO_LOCK();
+  /* Verify & plan placement of entire batch, erases happen here */
+  for (int r = 0; r < n; r++) {
+    const pf_block_t *block = (const pf_block_t*)reqs[r].block_bytes;
+    if (CANONICAL != pf_typeof(block)) {
+      reqs[r].result = PR_ERROR_UNSUPPORTED_BLOCK_TYPE;
+      continue;
+    }
+    const size_t block_size = pf_sizeof(block);
+    if (RECORD_SIZE(block_size) > SLOT_SIZE) {
+      reqs[r].result = PR_ERROR_BLOCK_TOO_LARGE;
+      continue;
+    }
+    // pre-hash the block (block.id is 64 bytes, while hash is 32)
+    // should be equal to hash given to crypto_sign as input.
+    crypto_blake2b(reqs[r].hash, 32, reqs[r].block_bytes, block_size);
+    /* Reject known blocks before paying for signature verification */
+    if (hindex_find(reqs[r].hash) >= 0 || batch_contains(reqs, r) ||
+        (state.cold && store_find_by_hash(reqs[r].hash) >= 0)) {
+      reqs[r].result = PR_ERROR_DUPLICATE;
+      continue;
+    }
+    if (0 != pf_verify_block(block, block->net.author)) {
+      reqs[r].result = PR_ERROR_INVALID_BLOCK;
+      continue;
+    }
+    const int n_pages = RECORD_PAGES(block_size);
+    int slot_idx = find_empty_slot(n_pages);
+    reserve_pages(slot_idx, n_pages);
+    reqs[r].result = slot_idx;
+    ESP_LOGI(TAG, "write_block() size: %zu, pages: %i => slot %i (sector %i, page %i)",
+      block_size, n_pages, slot_idx, SLOT_SECTOR(slot_idx), SLOT_PAGE(slot_idx));
+  }
+
+  /* Flush sector by sector, placement is sequential within a sector */
+  uint8_t *buffer = NULL;
+  int stored = 0;
+  int from = 0;
+  while (from < n) {
+    if (reqs[from].result < 0) {
+      from++;
+      continue;
     }
+    int to = from + 1;
+    while (to < n && (reqs[to].result < 0 || SLOT_SECTOR(reqs[to].result) == SLOT_SECTOR(reqs[from].result))) to++;
+    if (buffer == NULL) buffer = malloc(SLOT_SIZE);
+    flush_sector(reqs, from, to, buffer);
+    for (int r = from; r < to; r++) stored += reqs[r].result >= 0;
+    from = to;
   }
-  free(iter._tmp); /* I knew this was a bad idea */
-  // ESP_LOGI(TAG, "find_empty_slot(search exit: %i), iter: %i, decayed: %i, oldest: %i", exit, iter.offset, most_decayed_idx, oldest_block);
-  /* empty space found */
-  if (exit == -1) return iter.start + iter.offset - 1;
-  /* overwrite first most expired block*/
-  if (most_decayed_idx != -1) return iter.start + most_decayed_idx;
-  /* overwrite active block by age */
-  return iter.start + oldest_block;
+  free(buffer);
+  REPO_UNLOCK();
+  return stored;
 }
 
 pr_error_t pr_write_block(const uint8_t *block_bytes, uint8_t hops) {
-  pf_block_t *block = (pf_block_t*)block_bytes;
-  if (CANONICAL != pf_typeof(block)) return PR_ERROR_UNSUPPORTED_BLOCK_TYPE;
-  if (0 != pf_verify_block(block, block->net.author)) return PR_ERROR_INVALID_BLOCK;
-  const size_t block_size = pf_sizeof(block);
-  if (block_size + sizeof(flash_slot_t) > SLOT_SIZE) return PR_ERROR_BLOCK_TOO_LARGE; // Not 100% accurate, block-struct is counted twice.
-  ESP_LOGI(TAG, "write_block() size: %zu", block_size);
-
-  int slot_idx = find_empty_slot();
-  ESP_LOGI(TAG, "Writing to slot %i", slot_idx);
-
-  flash_slot_t *slot = calloc(1, SLOT_SIZE);
-
-  ESP_ERROR_CHECK(pr_get_slot(slot, slot_idx));
-  if (slot->glyph != UINT8_MAX) {
-    ESP_LOGI(TAG, "erasing slot%i: %zu, +%i", slot_idx, (size_t)SLOT_OFFSET(slot_idx), SLOT_SIZE);
-    ESP_ERROR_CHECK(esp_partition_erase_range(partition, SLOT_OFFSET(slot_idx), SLOT_SIZE));
-  } else ESP_LOGI(TAG, "Slot seems empty, skipping erase");
-  memset(slot, 0xff, SLOT_SIZE);
-
-  slot->glyph = SLOT_GLYPH;
-  slot->stored_at = time(NULL); // TODO: format is wrong
-  slot->hops = hops;
-
-  // pre-hash the block (block.id is 64 bytes, while hash is 32)
-  // should be equal to hash given to crypto_sign as input.
-  crypto_blake2b(slot->hash, 32, block_bytes, block_size);
-  memcpy(&slot->block, block_bytes, block_size);
-
-  esp_partition_write(partition, SLOT_OFFSET(slot_idx), slot, SLOT_SIZE);
-  ESP_LOGI(TAG, "Block flashed @0x%x", SLOT_OFFSET(slot_idx));
-  free(slot);
-  return slot_idx;
+  pr_write_req_t req = { .block_bytes = block_bytes, .hops = hops };
+  pr_write_blocks(&req, 1);
+  return req.result;
 }
 
 void pr_purge_flash() {
-  ESP_ERROR_CHECK(esp_partition_erase_range(partition, 0, MEM_SIZE));
+  REPO_LOCK();
+  ESP_ERROR_CHECK(flash_erase(0, SECTOR_OFFSET(N_SECTORS))); /* keep meta */
+  for (int i = 0; i < N_SECTORS; i++) erase_counts[i]++;
+  wear_snapshot();
+  hindex_clear();
+  aindex_clear();
+  sectors_clear();
+  sync_clear();
+  state.ckpt_changes = CKPT_MIN_CHANGES; /* stale checkpoint would only cost rescans */
+  cache_clear();
+  REPO_UNLOCK();
 }
 
-int pr_init() {
-  const esp_partition_t *part = esp_partition_find_first(
-    ESP_PARTITION_TYPE_DATA,
-    ESP_PARTITION_SUBTYPE_DATA_PiC0,
-    ESP_PARTITION_LABEL_PiC0
-  );
-  if (part == NULL) {
-    ESP_LOGE(TAG, "Could not find 'PiC0' partition, t: %i, sub_t: %i, label: %s",
-      ESP_PARTITION_TYPE_DATA,
-      ESP_PARTITION_SUBTYPE_DATA_PiC0,
-      ESP_PARTITION_LABEL_PiC0
-    );
+static int mount_backend(void) {
+  pr_geometry_t geometry = {0};
+  if (0 != backend->open(&geometry)) return -1;
+  if (geometry.erase_size != SECTOR_SIZE || geometry.size < MEM_SIZE) {
+    ESP_LOGE(TAG, "Unsupported geometry of %s, size: %zu, erz: %zu", backend->name, geometry.size, geometry.erase_size);
+    backend->close();
     return -1;
-  } else {
-    ESP_LOGI(TAG, "Partition Found: %s, type: %i, sub: %i, size: %"PRIu32" @%"PRIu32", erz: %"PRIu32" enc: %i",
-	part->label,
-	part->type,
-	part->subtype,
-	part->size,
-	part->address,
-	part->erase_size,
-	part->encrypted
-    );
-  }
-  partition = part;
-  /*
-  repo->_state = calloc(1, sizeof(pr_internal));
-  repo->_state->partition = part;
-
-  ESP_ERROR_CHECK(esp_partition_mmap(
-      repo->_state->partition,
-      0,
-      2097152,
-      ESP_PARTITION_MMAP_DATA,
-      &repo->_state->mmap_ptr,
-      &repo->_state->mmap_handle
-  ));*/
+  }
+  state.mmap_ptr = geometry.mapped;
+  state.mounted = 1;
+  return 0;
+}
+
+/* FNV-1a, tells whether a sector was appended to since the checkpoint */
+static uint32_t header_sum(uint16_t sector) {
+  const uint8_t *p = (const uint8_t*)get_sector_header(sector);
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < sizeof(struct sector_header); i++) h = (h ^ p[i]) * 16777619u;
+  return h;
+}
+
+/* Entry still describes the record in flash, the header sum
+ * alone passes a sector rewritten with the same page directory */
+static int ckpt_entry_current(const struct ckpt_entry *e) {
+  flash_slot_t tmp;
+  const flash_slot_t *rec = pr_get_slot(&tmp, e->slot, sizeof(flash_slot_t));
+  return rec->glyph == SLOT_GLYPH
+    && hash_prefix(rec->hash) == e->hash
+    && hash_prefix(rec->block.net.author) == e->author
+    && pf_read_utc(rec->block.net.date) == e->date;
+}
+
+/* Restores indexed record, shares & tombstone are read from flash */
+static void restore_slot(const struct ckpt_entry *e) {
+  flash_slot_t tmp;
+  const flash_slot_t *rec = pr_get_slot(&tmp, e->slot, offsetof(flash_slot_t, stored_at));
+  if (rec->glyph != SLOT_GLYPH || (~rec->iflags & FLAG_TOMB)) return;
+  hindex_insert((const uint8_t*)&e->hash, e->slot);
+  aindex_insert((const uint8_t*)&e->author, e->slot);
+  slots[e->slot].date = e->date;
+  slots[e->slot].shares = rec->decay ? __builtin_clzll(rec->decay) : 64;
+  slots[e->slot].pages = e->pages;
+  sector_refresh(SLOT_SECTOR(e->slot));
+  tindex[tindex_size++] = e->slot; /* sorted by pr_init() */
+}
+
+/* Restores sync chunks, records that were not restored are dropped
+ * and the sum of their chunk recomputed, the rescan inserts them again */
+static void ckpt_load_sync(size_t offset, uint32_t n_chunks) {
+  flash_slot_t tmp;
+  for (uint32_t k = 0; k < n_chunks; k++) {
+    struct sync_chunk *ch = &schunks[sync_chunks];
+    ESP_ERROR_CHECK(flash_read(offset, ch, SYNC_RECORD(0)));
+    if (ch->n > SYNC_CHUNK) break; /* garbage */
+    ESP_ERROR_CHECK(flash_read(offset + SYNC_RECORD(0), ch->slots, ch->n * sizeof(uint16_t)));
+    offset += SYNC_RECORD(ch->n);
+    int kept = 0;
+    for (int i = 0; i < ch->n; i++) {
+      if (ch->slots[i] < N_SLOTS && slots[ch->slots[i]].pages) ch->slots[kept++] = ch->slots[i];
+    }
+    if (kept != ch->n) {
+      memset(ch->sum, 0, sizeof(ch->sum));
+      for (int i = 0; i < kept; i++) sum_add(ch->sum, slot_hash(&tmp, ch->slots[i]));
+      ch->n = kept;
+    }
+    if (!kept) continue;
+    sync_chunks++;
+    sync_size += kept;
+  }
+  sync_pack();
+}
+
+/**
+ * Restores records of sectors unchanged since the checkpoint,
+ * clean[] is set for those. Runs after wear_load() & header scan.
+ * @return number of records restored
+ */
+static int ckpt_load(uint8_t *clean) {
+  struct ckpt_header hdr, newest;
+  state.ckpt_region = -1;
+  state.ckpt_generation = 0;
+  for (int r = 0; r < CKPT_REGIONS; r++) {
+    ESP_ERROR_CHECK(flash_read(CKPT_OFFSET(r), &hdr, sizeof(hdr)));
+    if (hdr.glyph != CKPT_GLYPH || hdr.n_entries > N_SLOTS || hdr.n_sync_chunks > SYNC_CHUNKS) continue;
+    if (state.ckpt_region != -1 && hdr.generation <= newest.generation) continue;
+    state.ckpt_region = r;
+    newest = hdr;
+  }
+  if (state.ckpt_region == -1) return 0;
+  hdr = newest;
+  const int r = state.ckpt_region;
+  state.ckpt_generation = hdr.generation;
+  for (int n = 0; n < N_SECTORS; n++) {
+    if (n % CKPT_CHUNK == 0) {
+      const int count = N_SECTORS - n < CKPT_CHUNK ? N_SECTORS - n : CKPT_CHUNK;
+      ESP_ERROR_CHECK(flash_read(CKPT_TABLE_OFFSET(r) + n * sizeof(struct ckpt_sector), ckpt_table, count * sizeof(struct ckpt_sector)));
+    }
+    const struct ckpt_sector *c = &ckpt_table[n % CKPT_CHUNK];
+    clean[n] = sectors[n].state == SECTOR_OPEN && c->erases == erase_counts[n] && c->sum == header_sum(n);
+  }
+  /* Two passes, a stale entry sends its whole sector to the rescan */
+  int n_restored = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    for (uint32_t i = 0; i < hdr.n_entries; i++) {
+      if (i % CKPT_CHUNK == 0) {
+        const uint32_t count = hdr.n_entries - i < CKPT_CHUNK ? hdr.n_entries - i : CKPT_CHUNK;
+        ESP_ERROR_CHECK(flash_read(CKPT_ENTRIES_OFFSET(r) + i * sizeof(struct ckpt_entry), ckpt_entries, count * sizeof(struct ckpt_entry)));
+      }
+      const struct ckpt_entry *e = &ckpt_entries[i % CKPT_CHUNK];
+      if (e->slot >= N_SLOTS || !clean[SLOT_SECTOR(e->slot)]) continue;
+      if (pass == 0) {
+        if (!ckpt_entry_current(e)) clean[SLOT_SECTOR(e->slot)] = 0;
+        continue;
+      }
+      restore_slot(e);
+      n_restored++;
+    }
+  }
+  ckpt_load_sync(CKPT_SYNC_OFFSET(r, hdr.n_entries), hdr.n_sync_chunks);
+  return n_restored;
+}
+
+int pr_init() {
+  if (repo_mutex == NULL) repo_mutex = xSemaphoreCreateRecursiveMutex();
+  if (0 != mount_backend()) return -1;
+  cache_init();
+
+  wear_load();
+  /* Build hash index, sector states and heaps in one pass */
+  hindex_clear();
+  aindex_clear();
+  sectors_clear();
+  sync_clear();
+  int n_torn = 0;
+  for (int n = 0; n < N_SECTORS; n++) {
+    const struct sector_header *hdr = get_sector_header(n);
+    if (hdr->glyph == UINT8_MAX) { /* erased, verified on first use */
+      sectors[n].state = SECTOR_UNVERIFIED;
+      continue;
+    }
+    sectors[n].free = 0;
+    heap_remove(&erased_heap, n);
+    if (hdr->glyph != SECTOR_GLYPH) {
+      sectors[n].state = SECTOR_DIRTY;
+      sector_refresh(n);
+      continue;
+    }
+    sectors[n].state = SECTOR_OPEN;
+    for (int p = PAGES_PER_SECTOR - 1; p >= 0 && hdr->pages[p] == PAGE_FREE; p--) sectors[n].free++;
+    /* Recovery, torn records are never indexed and their pages
+     * stay claimed until the sector is compacted or recycled */
+    for (int p = 0; p < PAGES_PER_SECTOR; p++) n_torn += hdr->pages[p] == PAGE_HEAD && hdr->commit[p] != PAGE_COMMIT;
+    sector_refresh(n);
+  }
+  static uint8_t clean[N_SECTORS];
+  memset(clean, 0, sizeof(clean));
+  const int n_restored = ckpt_load(clean);
+  /* Rescan what the checkpoint does not cover */
+  pr_iterator_t iter = { .mode = PR_ITER_HEADERS };
+  int n_rescanned = 0;
+  pr_scan_t *scan = scan_open(PR_SCAN_DEPTH, clean);
+  while (!pr_scan_next(scan, &iter)) {
+    hindex_insert(iter.meta.hash, iter.slot);
+    aindex_insert(iter.block->net.author, iter.slot);
+    track_slot(iter.slot, iter.block, iter.meta.decay);
+    tindex[tindex_size++] = iter.slot; /* sorted once below */
+    if (iter.meta.hops < PR_MAX_HOPS) sync_insert(iter.slot, iter.meta.hash);
+    n_rescanned++;
+  }
+  pr_scan_close(scan);
+  for (int n = 0; n < N_SECTORS; n++) {
+    if (!clean[n] && sectors[n].state == SECTOR_OPEN) state.ckpt_changes = CKPT_MIN_CHANGES; /* rescans are slow */
+  }
+  qsort(tindex, tindex_size, sizeof(uint16_t), tindex_cmp);
+  const int n_blocks = tindex_size;
+  /* resume appending to the least filled sector */
+  for (int n = 0; n < N_SECTORS; n++) {
+    if (sectors[n].state != SECTOR_OPEN || !sectors[n].free) continue;
+    if (state.open == -1 || sectors[n].free > sectors[state.open].free) state.open = n;
+  }
+  ESP_LOGI(TAG, "Index built, %i blocks (%i from checkpoint gen %"PRIu32", %i rescanned), %i torn, %i syncable, open sector: %i",
+    n_blocks, n_restored, state.ckpt_generation, n_rescanned, n_torn, sync_size, state.open);
   return 0;
 }
 
 void pr_deinit() {
-  /*
-  esp_partition_munmap(repo->_state->mmap_handle);
-  repo->_state->mmap_ptr = NULL;
-  repo->_state->mmap_handle = 0;
-  */
-  /* free internal state */
-  // free(repo->_state);
+  if (!state.mounted) return;
+  if (state.cold) storage_deinit();
+  cache_clear();
+  backend->close();
+  memset(&state, 0, sizeof(state));
+  state.open = -1;
+  state.hdr_cached = -1;
+  state.wear_meta = -1;
+  state.ckpt_region = -1;
 }
 
-int pr_find_by_hash(pr_iterator_t *iter, uint8_t *hash) {
-  int i = 0;
-  while (!pr_iter_next(iter)) {
-    if (0 == memcmp(iter->meta.hash, hash, 32)) return i;
-    i++;
+int pr_iter_by_date(pr_iterator_t *iter, uint64_t from, uint64_t to, int newest_first) {
+  iter->block = NULL;
+  while (1) {
+    REPO_LOCK();
+    int i;
+    if (!iter->offset) i = newest_first ? tindex_lower_bound(to, 0) - 1 : tindex_lower_bound(from, 0);
+    else if (newest_first) i = tindex_lower_bound(iter->_date, iter->slot) - 1;
+    else i = tindex_lower_bound(iter->_date, iter->slot + 1);
+    int done = i < 0 || i >= tindex_size || slots[tindex[i]].date < from || slots[tindex[i]].date >= to;
+    if (done) {
+      REPO_UNLOCK();
+      return 1;
+    }
+    uint16_t idx = tindex[i];
+    iter->offset = 1;
+    iter->_date = slots[idx].date;
+    int err = load_slot(iter, idx);
+    REPO_UNLOCK();
+    if (0 == err) return 0;
   }
-  return -1;
+}
+
+int pr_iter_by_author(pr_iterator_t *iter, const uint8_t *author) {
+  iter->block = NULL;
+  while (1) {
+    REPO_LOCK();
+    uint16_t next;
+    if (!iter->offset) {
+      int e = aindex_find(hash_prefix(author));
+      next = e < 0 ? SLOT_NONE : aindex[e].head;
+      iter->offset = 1;
+    } else next = anext[iter->slot];
+    if (next == SLOT_NONE && iter->offset == 1) { /* continue through overflow */
+      next = aoverflow;
+      iter->offset = 2;
+    }
+    int found = next != SLOT_NONE && 0 == load_slot(iter, next) && 0 == memcmp(iter->block->net.author, author, sizeof(iter->block->net.author));
+    REPO_UNLOCK();
+    if (next == SLOT_NONE) return 1;
+    if (found) return 0;
+  }
+}
+
+int pr_find_by_hash(pr_iterator_t *iter, const uint8_t *hash) {
+  REPO_LOCK(); /* probe & read in one go, the evictor may not erase in between */
+  int slot = cache_load(iter, hash);
+  if (slot >= 0) {
+    REPO_UNLOCK();
+    return slot;
+  }
+  uint32_t prefix = hash_prefix(hash);
+  for (uint32_t i = prefix & HINDEX_MASK; hindex[i].slot != HINDEX_EMPTY; i = (i + 1) & HINDEX_MASK) {
+    if (hindex[i].prefix != prefix) continue;
+    if (0 != load_slot(iter, hindex[i].slot)) continue; /* index out of sync? */
+    if (0 != memcmp(iter->meta.hash, hash, 32)) continue;
+    slot = hindex[i].slot;
+    break;
+  }
+  if (slot < 0 && state.cold) {
+    int record = store_find_by_hash(hash);
+    if (record >= 0 && 0 == load_cold(iter, record)) slot = iter->slot;
+  }
+  if (slot < 0) {
+    REPO_UNLOCK();
+    iter->block = NULL;
+    return -1;
+  }
+  /* served blocks are likely asked for again */
+  if (iter->body_loaded) cache_put(iter->meta.hash, iter->block, iter->meta.hops, iter->meta.decay, slot);
+  REPO_UNLOCK();
+  return slot;
+}
+
+int pr_decay(int slot_idx, const uint8_t *hash, int n) {
+  if (slot_idx >= PR_COLD_SLOT && state.cold) {
+    REPO_LOCK();
+    const int shares = store_decay(slot_idx - PR_COLD_SLOT, hash, n);
+    cache_set_shares(hash, slot_idx, shares);
+    REPO_UNLOCK();
+    return shares;
+  }
+  if (slot_idx < 0 || slot_idx >= N_SLOTS) return -1;
+  REPO_LOCK();
+  flash_slot_t tmp;
+  const flash_slot_t *slot = slots[slot_idx].pages ? pr_get_slot(&tmp, slot_idx, sizeof(flash_slot_t)) : NULL;
+  /* recycled between lookup and decay, don't count shares of a stranger */
+  if (slot == NULL || 0 != memcmp(slot->hash, hash, sizeof(slot->hash))) {
+    REPO_UNLOCK();
+    return -1;
+  }
+  const uint64_t old = slot->decay;
+  /* Shift in zeroes from the top, only pulls bits 1 => 0, no erase needed.
+   * Saturates at a single bit, decay == 0 is reserved for entombed slots */
+  uint64_t decay = n < 64 ? old >> n : 0;
+  if (decay == 0) decay = old ? 1 : 0;
+  if (decay != old) {
+    ESP_ERROR_CHECK(flash_write(SLOT_OFFSET(slot_idx) + offsetof(flash_slot_t, decay), &decay, sizeof(decay)));
+  }
+  slots[slot_idx].shares = decay ? __builtin_clzll(decay) : 64;
+  sector_refresh(SLOT_SECTOR(slot_idx));
+  int shares = slots[slot_idx].shares;
+  REPO_UNLOCK();
+  return shares;
+}
+
+int pr_delete_block(const uint8_t *hash) {
+  REPO_LOCK();
+  cache_remove(hash);
+  int slot_idx = hindex_find(hash);
+  if (slot_idx < 0) {
+    int record = state.cold ? store_find_by_hash(hash) : -1;
+    if (record < 0 || 0 != store_delete_block(record)) {
+      REPO_UNLOCK();
+      return -1;
+    }
+    if (evict_handler != NULL) evict_handler(hash);
+    REPO_UNLOCK();
+    return PR_COLD_SLOT + record;
+  }
+  flash_slot_t tmp;
+  const flash_slot_t *rec = pr_get_slot(&tmp, slot_idx, sizeof(flash_slot_t));
+  aindex_remove(rec->block.net.author, slot_idx);
+  uint8_t iflags = rec->iflags & ~FLAG_TOMB;
+  ESP_ERROR_CHECK(flash_write(SLOT_OFFSET(slot_idx) + offsetof(flash_slot_t, iflags), &iflags, 1));
+  hindex_remove(hash, slot_idx);
+  tindex_remove(slot_idx);
+  sync_remove(slot_idx, hash);
+  slots[slot_idx].pages = 0; /* pages stay claimed until sector is erased */
+  sector_refresh(SLOT_SECTOR(slot_idx));
+  if (evict_handler != NULL) evict_handler(hash);
+  REPO_UNLOCK();
+  return slot_idx;
+}
+
+/* Sector holds nothing but tombstones or garbage */
+static int is_reclaimable(uint16_t sector) {
+  if (sectors[sector].state != SECTOR_OPEN && sectors[sector].state != SECTOR_DIRTY) return 0;
+  if (sector == state.open) return 0;
+  for (int s = sector * PAGES_PER_SECTOR; s < (sector + 1) * PAGES_PER_SECTOR; s++) {
+    if (slots[s].pages) return 0;
+  }
+  return 1;
+}
+
+int pr_compact(int max_sectors) {
+  int n = 0;
+  for (int i = 0; i < N_SECTORS && n < max_sectors; i++) {
+    REPO_LOCK(); /* one sector at a time, writers may interleave */
+    uint16_t sector = state.compact;
+    state.compact = (sector + 1) % N_SECTORS;
+    if (is_reclaimable(sector)) {
+      evict_sector(sector);
+      n++;
+    }
+    REPO_UNLOCK();
+  }
+  return n;
+}
+
+int pr_verify(void) {
+  int n_corrupt = 0;
+  uint8_t hash[32];
+  pr_iterator_t iter = {0};
+  pr_scan_t *scan = pr_scan_open(PR_SCAN_DEPTH);
+  while (!pr_scan_next(scan, &iter)) {
+    crypto_blake2b(hash, sizeof(hash), (const uint8_t*)iter.block, pf_sizeof(iter.block));
+    if (0 == memcmp(hash, iter.meta.hash, sizeof(hash))) continue;
+    ESP_LOGW(TAG, "Slot %i fails integrity check, entombing", iter.slot);
+    n_corrupt++;
+    REPO_LOCK(); /* unless recycled since it was read */
+    if (hindex_find(iter.meta.hash) == iter.slot) pr_delete_block(iter.meta.hash);
+    REPO_UNLOCK();
+  }
+  pr_scan_close(scan);
+  return n_corrupt;
+}
+
+void pr_wear_stats(pr_wear_t *wear) {
+  memset(wear, 0, sizeof(pr_wear_t));
+  REPO_LOCK();
+  wear->min_erases = UINT32_MAX;
+  for (int i = 0; i < N_SECTORS; i++) {
+    if (erase_counts[i] < wear->min_erases) wear->min_erases = erase_counts[i];
+    if (erase_counts[i] > wear->max_erases) wear->max_erases = erase_counts[i];
+    wear->total_erases += erase_counts[i];
+  }
+  wear->bin_width = (wear->max_erases - wear->min_erases) / PR_WEAR_BINS + 1;
+  for (int i = 0; i < N_SECTORS; i++) {
+    wear->bins[(erase_counts[i] - wear->min_erases) / wear->bin_width]++;
+  }
+  REPO_UNLOCK();
+}
+
+/* Cold records make room for migrating ones while the repo is locked */
+static void cold_evicted(const uint8_t *hash) {
+  cache_remove(hash);
+  if (evict_handler != NULL) evict_handler(hash);
+}
+
+int pr_cold_attach(void) {
+  if (state.cold) return 0;
+  if (ESP_OK != storage_init(NULL)) {
+    ESP_LOGW(TAG, "No cold tier, blocks are dropped on recycling");
+    return -1;
+  }
+  store_set_evict_handler(cold_evicted);
+  REPO_LOCK();
+  state.cold = 1;
+  REPO_UNLOCK();
+  return 0;
+}
+
+int pr_cold_migrate(int min_erased) {
+  if (!state.cold) return 0;
+  REPO_LOCK();
+  /* next in line for recycling, see recycle_candidate() */
+  int sector = erased_heap.size < min_erased ? recycle_candidate() : -1;
+  if (sector == state.open) sector = -1; /* freshest, leave it be */
+  if (sector != -1) evict_sector(sector);
+  REPO_UNLOCK();
+  return sector != -1;
+}
+
+int pr_checkpoint(void) {
+  REPO_LOCK();
+  if (state.ckpt_changes < CKPT_MIN_CHANGES) {
+    REPO_UNLOCK();
+    return 0;
+  }
+  /* Overwrite the older region, only erase what entries & sync chunks need */
+  const int r = state.ckpt_region == 0 ? 1 : 0;
+  const size_t size = CKPT_SYNC_OFFSET(r, tindex_size) - CKPT_OFFSET(r) + sync_chunks * SYNC_RECORD(0) + sync_size * sizeof(uint16_t);
+  const int n_erase = (size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+  ESP_ERROR_CHECK(flash_erase(CKPT_OFFSET(r), n_erase * SECTOR_SIZE));
+  for (int n = 0; n < n_erase; n++) wear_count(CKPT_SECTOR(r) + n);
+  for (int n = 0; n < N_SECTORS; n += CKPT_CHUNK) {
+    const int count = N_SECTORS - n < CKPT_CHUNK ? N_SECTORS - n : CKPT_CHUNK;
+    for (int i = 0; i < count; i++) {
+      ckpt_table[i].erases = erase_counts[n + i];
+      ckpt_table[i].sum = header_sum(n + i);
+    }
+    ESP_ERROR_CHECK(flash_write(CKPT_TABLE_OFFSET(r) + n * sizeof(struct ckpt_sector), ckpt_table, count * sizeof(struct ckpt_sector)));
+  }
+  flash_slot_t tmp;
+  for (int i = 0; i < tindex_size; i += CKPT_CHUNK) {
+    const int count = tindex_size - i < CKPT_CHUNK ? tindex_size - i : CKPT_CHUNK;
+    for (int k = 0; k < count; k++) {
+      const uint16_t slot = tindex[i + k];
+      const flash_slot_t *rec = pr_get_slot(&tmp, slot, sizeof(flash_slot_t));
+      ckpt_entries[k].slot = slot;
+      ckpt_entries[k].pages = slots[slot].pages;
+      ckpt_entries[k].date = slots[slot].date;
+      ckpt_entries[k].hash = hash_prefix(rec->hash);
+      ckpt_entries[k].author = hash_prefix(rec->block.net.author);
+    }
+    ESP_ERROR_CHECK(flash_write(CKPT_ENTRIES_OFFSET(r) + i * sizeof(struct ckpt_entry), ckpt_entries, count * sizeof(struct ckpt_entry)));
+  }
+  size_t offset = CKPT_SYNC_OFFSET(r, tindex_size);
+  for (int c = 0; c < sync_chunks; c++) {
+    ESP_ERROR_CHECK(flash_write(offset, &schunks[c], SYNC_RECORD(schunks[c].n)));
+    offset += SYNC_RECORD(schunks[c].n);
+  }
+  struct ckpt_header hdr = {
+    .glyph = CKPT_GLYPH,
+    .generation = state.ckpt_generation + 1,
+    .n_entries = tindex_size,
+    .n_sync_chunks = sync_chunks
+  };
+  ESP_ERROR_CHECK(flash_write(CKPT_OFFSET(r), &hdr, sizeof(hdr)));
+  state.ckpt_generation = hdr.generation;
+  state.ckpt_region = r;
+  state.ckpt_changes = 0;
+  REPO_UNLOCK();
+  ESP_LOGI(TAG, "Checkpoint gen %"PRIu32", %"PRIu32" blocks", hdr.generation, hdr.n_entries);
+  return 1;
+}
+
+void pr_cache_stats(pr_cache_stats_t *stats) {
+  REPO_LOCK();
+  stats->hits = cache.hits;
+  stats->misses = cache.misses;
+  stats->bytes = cache.used;
+  stats->budget = cache.budget;
+  stats->entries = 0;
+  for (int i = 0; i < CACHE_MAX_ENTRIES; i++) stats->entries += cache.entries[i].slot != -1;
+  REPO_UNLOCK();
+}
+
+size_t pr_sync_size(void) {
+  REPO_LOCK();
+  size_t size = sync_size;
+  REPO_UNLOCK();
+  return size;
+}
+
+size_t pr_sync_read(size_t begin, size_t n, pr_sync_item_t *items) {
+  REPO_LOCK();
+  flash_slot_t tmp;
+  size_t off = begin, i = 0;
+  for (int c = sync_seek(&off); i < n && c < sync_chunks; i++) {
+    const uint16_t slot = schunks[c].slots[off];
+    items[i].date = slots[slot].date;
+    memcpy(items[i].hash, slot_hash(&tmp, slot), 32);
+    if (++off == schunks[c].n) {
+      off = 0;
+      c++;
+    }
+  }
+  REPO_UNLOCK();
+  return i;
+}
+
+size_t pr_sync_lower_bound(size_t first, size_t last, uint64_t date, const uint8_t *hash) {
+  REPO_LOCK();
+  int offset;
+  size_t pos = 0;
+  const int c = sync_locate(date, hash, &offset);
+  for (int k = 0; k < c; k++) pos += schunks[k].n;
+  pos += offset;
+  REPO_UNLOCK();
+  /* sorted, so bounding the result is the same as searching within */
+  return pos < first ? first : pos > last ? last : pos;
+}
+
+void pr_sync_sum(size_t begin, size_t end, uint8_t *sum) {
+  memset(sum, 0, 32);
+  REPO_LOCK();
+  flash_slot_t tmp;
+  size_t off = begin, left = end > begin ? end - begin : 0;
+  for (int c = sync_seek(&off); left && c < sync_chunks; c++, off = 0) {
+    const struct sync_chunk *ch = &schunks[c];
+    const size_t take = ch->n - off < left ? ch->n - off : left;
+    left -= take;
+    if (take > ch->n / 2u) { /* mostly covered, subtract what is not */
+      sum_add(sum, ch->sum);
+      for (size_t i = 0; i < off; i++) sum_sub(sum, slot_hash(&tmp, ch->slots[i]));
+      for (size_t i = off + take; i < ch->n; i++) sum_sub(sum, slot_hash(&tmp, ch->slots[i]));
+    } else {
+      for (size_t i = off; i < off + take; i++) sum_add(sum, slot_hash(&tmp, ch->slots[i]));
+    }
+  }
+  REPO_UNLOCK();
+}
+
+void pr_sync_hold(void) {
+  REPO_LOCK();
+}
+
+void pr_sync_release(void) {
+  REPO_UNLOCK();
 }
@@ -4,16 +4,30 @@
 
 typedef void (*reply_t) (uint8_t data, uint32_t length, int close);
 
+/* Largest frame handlers send, transports must receive it whole.
+ * 4KiB negentropy message or exchange frame plus a small header */
+#define PW_MAX_FRAME_SIZE (4096 + 2)
+
 typedef enum {
   PW_REPLY = 0,
-  PW_NOOP,
-  PW_CLOSE
+  PW_NOOP, /* nothing to send, wait for the peer */
+  PW_CLOSE,
+  PW_REPLY_MORE /* send, then pull the next frame, see on_data */
 } pwire_ret_t;
 
+/**
+ * on_data receives a frame and may answer with one.
+ * After PW_REPLY_MORE the transport sends the frame without
+ * waiting for the peer and calls on_data again with
+ * message NULL to pull the next, until something else is returned.
+ * on_open sets session, the transport keeps it per connection
+ * and hands it back with every data and the close event.
+ */
 typedef struct {
   int initiator;
   uint8_t *message;
   uint32_t size;
+  void *session; /* link-state of the handlers, NULL until opened */
 } pwire_event_t;
 
 typedef pwire_ret_t (*on_open_cb) (pwire_event_t *event);
@@ -1,15 +1,15 @@
 #include "recon_sync.h"
 #include "negentropy.h"
-#include "negentropy/storage/BTreeMem.h"
+#include "negentropy/storage/base.h"
 #include "esp_log.h"
 #include "picofeed.h"
 #include "pwire.h"
 #include "string.h"
 #include "snail.h"
 #include "time.h"
-#include "monocypher.h"
 #include <assert.h>
 #include <cstdint>
+#include <algorithm>
 
 /****
  *
@@ -25,44 +25,186 @@
 #define HASH2STR(a) (a)[0], (a)[1], (a)[2], (a)[3], (a)[30], (a)[31]
 #define HASHSTR "%02x%02x %02x%02x..%02x%02x"
 #define MAX_FRAME_SIZE 4096
+#define FRAME_BUFFER_SIZE (MAX_FRAME_SIZE + 1) /* type + negentropy message */
+static_assert(FRAME_BUFFER_SIZE <= PW_MAX_FRAME_SIZE, "peers would drop our frames");
 #define ID_SIZE 32
 static const char* TAG = "recon";
-static uint8_t *buffer = NULL;
 
 #define T_OK	    0
 #define T_RECONCILE 0b0001
 #define T_EXCHANGE  0b0010
 #define T_GIVE_SET  0b0100
 #define T_WANT_SET  0b1000
+#define T_BATCH     0b10000
+#define T_HELLO     0b100000 /* on T_EXCHANGE, window in want[0], see RECON_WINDOW */
 
-static auto storage = negentropy::storage::BTreeMem(); /* One global index */
-static negentropy::Negentropy<negentropy::storage::BTreeMem> *ne = NULL;
+/**
+ * Negentropy storage over the repo's sync index, see pr_sync_size()
+ * Items are read from flash on demand and the index is kept
+ * up to date by the repo, so there is nothing to build or insert.
+ */
+struct RepoStorage : negentropy::StorageBase {
+  uint64_t size() override { return pr_sync_size(); }
+
+  const negentropy::Item &getItem(size_t i) override {
+    /* callers compare neighbours, keep a few alive */
+    negentropy::Item &item = items[next++ % 4];
+    pr_sync_item_t it;
+    if (pr_sync_read(i, 1, &it)) set(item, it);
+    return item;
+  }
+
+  void iterate(size_t begin, size_t end, std::function<bool(const negentropy::Item &, size_t)> cb) override {
+    pr_sync_item_t batch[8];
+    negentropy::Item item;
+    for (size_t i = begin; i < end;) {
+      size_t n = pr_sync_read(i, std::min(end - i, sizeof(batch) / sizeof(batch[0])), batch);
+      if (!n) return;
+      for (size_t k = 0; k < n; k++, i++) {
+        set(item, batch[k]);
+        if (!cb(item, i)) return;
+      }
+    }
+  }
+
+  size_t findLowerBound(size_t first, size_t last, const negentropy::Bound &value) override {
+    return pr_sync_lower_bound(first, last, value.item.timestamp, value.item.id);
+  }
+
+  negentropy::Fingerprint fingerprint(size_t begin, size_t end) override {
+    negentropy::Accumulator acc;
+    pr_sync_sum(begin, end, acc.buf);
+    return acc.getFingerprint(end - begin);
+  }
+
+private:
+  static void set(negentropy::Item &item, const pr_sync_item_t &it) {
+    item.timestamp = it.date;
+    memcpy(item.id, it.hash, ID_SIZE);
+  }
+  negentropy::Item items[4];
+  size_t next = 0;
+};
+
+/* One global index, sessions take turns under pr_sync_hold() */
+static RepoStorage storage;
+
+#define STAGE_SIZE (MAX_FRAME_SIZE * 2)
+#define STAGE_MAX_BLOCKS 8
+#define BATCH_MAX_WANTS 32 /* per frame */
+#define BACKLOG_MAX 64 /* wants queued by the non-initiator */
+
+/**
+ * Pipelining, each side may have up to window batches in flight.
+ * The initiator offers RECON_WINDOW in a T_EXCHANGE | T_HELLO before
+ * its first exchange, the non-initiator answers with the smaller of
+ * both. Baseline peers ignore the flag and answer a plain T_EXCHANGE,
+ * which leaves the window at 1 and the exchange at one want and one
+ * block per round trip, they would drop the connection on T_BATCH.
+ * Sending a batch with wants or blocks costs a credit, the peer
+ * returns it through ack in its next batch. Batches holding
+ * neither are pure acks, cost nothing and are never acked.
+ */
+#define RECON_WINDOW 4
+#define HELLO_UNSENT 0
+#define HELLO_SENT 1
+#define HELLO_DONE 2
+
+/**
+ * Link-state, one per connection. Created by recon_onopen()
+ * and handed back by the transport in pwire_event_t.session
+ */
+struct recon_session {
+  uint8_t *buffer; /* outgoing frame */
+  negentropy::Negentropy<RepoStorage> *ne;
+  std::vector<std::string> have;
+  std::vector<std::string> need;
+  std::optional<std::string> reply;
+
+  /* Received blocks are staged and flushed to repo in batches */
+  uint8_t *stage;
+  size_t stage_used;
+  pr_write_req_t staged[STAGE_MAX_BLOCKS];
+  int n_staged;
+
+  /* Batched exchange state, see batch_header */
+  std::vector<std::string> wanted; /* asked for by peer, not yet given */
+  int remote_backlog;
+
+  /* see RECON_WINDOW */
+  int hello; /* HELLO_* */
+  int batched; /* peer answered T_HELLO, speaks T_BATCH */
+  int window; /* agreed, 1 is lockstep */
+  int credit;
+  int unacked; /* peer's batches received since we last acked */
+  uint8_t inflight[RECON_WINDOW]; /* wants per unacked batch, ring */
+  int inflight_head, inflight_n;
+  int wants_in_flight;
+
+  struct recon_session *next;
+};
+
+/* Open sessions, guarded by pr_sync_hold() for on_block_evicted() */
+static struct recon_session *sessions = NULL;
+
+/* Starts an exchange round, nothing is in flight after T_RECONCILE */
+static void window_reset(struct recon_session *s, int size) {
+  s->window = std::max(1, std::min(size, RECON_WINDOW));
+  s->credit = s->window;
+  s->unacked = 0;
+  s->inflight_head = s->inflight_n = 0;
+  s->wants_in_flight = 0;
+  s->remote_backlog = 0;
+}
+
+static void session_free(struct recon_session *s) {
+  free(s->stage);
+  free(s->buffer);
+  delete s->ne;
+  delete s;
+}
 
 static pwire_ret_t recon_onopen(pwire_event_t *ev) {
   ESP_LOGI(TAG, "pwire_onopen initiator: %i", ev->initiator);
-  if (buffer != NULL) {
-    ESP_LOGE(TAG, "memory still in use");
-    abort();
-  }
   /* Initialize link-state */
-  buffer = (uint8_t*)calloc(1, 4098);
+  struct recon_session *s = new recon_session();
+  s->buffer = (uint8_t*)calloc(1, FRAME_BUFFER_SIZE);
+  s->stage = (uint8_t*)malloc(STAGE_SIZE);
+  if (s->buffer == NULL || s->stage == NULL) {
+    ESP_LOGE(TAG, "Out of memory, refusing session");
+    session_free(s);
+    return PW_CLOSE;
+  }
+  window_reset(s, 1);
+  s->ne = new Negentropy<RepoStorage>(storage, 4096);
 
-  ne = new Negentropy<negentropy::storage::BTreeMem>(storage, 4096);
+  pr_sync_hold();
+  s->next = sessions;
+  sessions = s;
+  pr_sync_release();
+  ev->session = s;
 
   if (ev->initiator) {
-    std::string msg = ne->initiate();
+    pr_sync_hold();
+    std::string msg = s->ne->initiate();
+    pr_sync_release();
     ESP_LOGI(TAG, "ngn_init() first msg size: %zu", msg.length());
-    buffer[0] = T_RECONCILE;
-    memcpy(buffer + 1, msg.data(), msg.length());
-    ev->message = buffer;
+    s->buffer[0] = T_RECONCILE;
+    memcpy(s->buffer + 1, msg.data(), msg.length());
+    ev->message = s->buffer;
     ev->size = msg.length() + 1;
   }
   return PW_REPLY;
 }
 
-static std::vector<std::string> have;
-static std::vector<std::string> need;
-static std::optional<std::string> reply;
+/* Repo dropped a block for good, stop offering it.
+ * Runs with the repo locked, so have is only touched under pr_sync_hold() */
+static void on_block_evicted(const uint8_t *hash) {
+  std::string_view id((const char*)hash, ID_SIZE);
+  for (struct recon_session *s = sessions; s != NULL; s = s->next) {
+    s->have.erase(std::remove(s->have.begin(), s->have.end(), id), s->have.end());
+  }
+}
 
 struct __attribute__((packed)) exchange_packet {
   uint8_t type;
@@ -71,14 +213,56 @@ struct __attribute__((packed)) exchange_packet {
   uint8_t block_bytes[0];
 };
 
+/**
+ * Batched exchange, as many wants & blocks as fit into a frame:
+ * [header] [n_wants * ID_SIZE] [n_gives * (batch_give + block)]
+ * Wants are queued by the receiver and given over the next replies,
+ * backlog tells how many the sender still has queued to give.
+ * The initiator keeps sending (possibly empty) batches until
+ * have, need and the remote backlog are all drained.
+ */
+struct __attribute__((packed)) batch_header {
+  uint8_t type; /* T_BATCH */
+  uint8_t n_wants;
+  uint8_t n_gives;
+  uint8_t backlog;
+  uint8_t ack; /* batches received since sender's last, see RECON_WINDOW */
+  uint8_t wants[0];
+};
+
+struct __attribute__((packed)) batch_give {
+  uint8_t hops;
+  uint16_t size;
+  uint8_t block_bytes[0];
+};
 
-/* Process given block and store to flash */
-static int accept_incoming_block(const pwire_event_t *ev) {
-  struct exchange_packet *x = (struct exchange_packet*) ev->message;
-  if (!(x->type & (T_GIVE_SET | T_EXCHANGE))) return 0;
 
-  uint16_t expected_block_size = ev->size - sizeof(struct exchange_packet);
-  pf_block_t *block = (pf_block_t*)x->block_bytes;
+/* Writes staged blocks to flash, the repo updates the sync index */
+static void flush_staged_blocks(struct recon_session *s) {
+  if (!s->n_staged) return;
+  int stored = pr_write_blocks(s->staged, s->n_staged);
+  for (int i = 0; i < s->n_staged; i++) {
+    if (s->staged[i].result == PR_ERROR_DUPLICATE) continue;
+    if (s->staged[i].result < 0) {
+      ESP_LOGE(TAG, "Failed to store block, error: %i", s->staged[i].result);
+      continue;
+    }
+    const uint8_t *hash = s->staged[i].hash; /* hashed once by repo */
+    ESP_LOGI(TAG, "Block accepted " HASHSTR, HASH2STR(hash));
+    // TODO: READJUST SYSTEM CLOCK/SWARM-TIME: time = time + (time - block-time) / 2
+  }
+  ESP_LOGI(TAG, "Flushed %i/%i staged blocks", stored, s->n_staged);
+  s->n_staged = 0;
+  s->stage_used = 0;
+}
+
+/* Checks given block and stages it for storage, hops as sent */
+static int stage_block(struct recon_session *s, const uint8_t *block_bytes, uint16_t expected_block_size, uint8_t hops) {
+  const pf_block_t *block = (const pf_block_t*)block_bytes;
+  if (expected_block_size < sizeof(pf_block_t)) {
+    ESP_LOGE(TAG, "Truncated block received, %i bytes", expected_block_size);
+    return -1;
+  }
   pf_block_type_t btype = pf_typeof(block);
   if (btype != CANONICAL) {
     ESP_LOGE(TAG, "Unsupported block type %i", btype);
@@ -90,44 +274,235 @@ static int accept_incoming_block(const pwire_event_t *ev) {
     ESP_LOGE(TAG, "Invalid block received, expected: %i, got: %i", expected_block_size, block_size);
     return -1;
   }
-  ++x->offer_hops; // Receiver increments hop count
-  int slot_id = pr_write_block(x->block_bytes, x->offer_hops);
-  if (slot_id < 0) {
-    ESP_LOGE(TAG, "Failed to store block, error: %i", slot_id);
-    return -1;
+  ++hops; // Receiver increments hop count
+  if (s->n_staged == STAGE_MAX_BLOCKS || s->stage_used + block_size > STAGE_SIZE) flush_staged_blocks(s);
+  memcpy(s->stage + s->stage_used, block_bytes, block_size);
+  s->staged[s->n_staged++] = pr_write_req_t{ s->stage + s->stage_used, hops, 0, {0} };
+  s->stage_used += block_size;
+  return 0;
+}
+
+/* Process given block and stage it for storage */
+static int accept_incoming_block(const pwire_event_t *ev) {
+  struct exchange_packet *x = (struct exchange_packet*) ev->message;
+  if (!(x->type & T_GIVE_SET)) return 0;
+  if (ev->size < sizeof(struct exchange_packet)) return -1;
+  return stage_block((struct recon_session*) ev->session, x->block_bytes, ev->size - sizeof(struct exchange_packet), x->offer_hops);
+}
+
+/* Stages given blocks of a batch and queues its wants, -1 when malformed */
+static int drain_batch(const pwire_event_t *ev, std::vector<std::string> *wants) {
+  struct recon_session *s = (struct recon_session*) ev->session;
+  const struct batch_header *b = (const struct batch_header*) ev->message;
+  if (ev->size < sizeof(struct batch_header)) return -1;
+  if (ev->size < sizeof(struct batch_header) + b->n_wants * ID_SIZE) return -1;
+  s->remote_backlog = b->backlog;
+  for (int i = 0; i < b->ack && s->inflight_n; i++, s->inflight_n--) { /* credit returned */
+    s->wants_in_flight -= s->inflight[s->inflight_head];
+    s->inflight_head = (s->inflight_head + 1) % RECON_WINDOW;
+    s->credit++;
   }
-  // Unecessary rehash - block is hashed already by p_repo
-  uint8_t hash[32];
-  crypto_blake2b(hash, 32, x->block_bytes, block_size);
-  // Update index
-  if (x->offer_hops < PR_MAX_HOPS) storage.insert(pf_read_utc(block->net.date), std::string_view((const char*)hash, 32));
-  ESP_LOGI(TAG, "Block accepted " HASHSTR, HASH2STR(hash));
-  // TODO: READJUST SYSTEM CLOCK/SWARM-TIME: time = time + (time - block-time) / 2
+  if (b->n_wants || b->n_gives) s->unacked++;
+  const uint8_t *p = b->wants;
+  for (int i = 0; i < b->n_wants; i++, p += ID_SIZE) {
+    if (wants != NULL && wants->size() < BACKLOG_MAX) wants->emplace_back((const char*)p, ID_SIZE);
+  }
+  const uint8_t *end = ev->message + ev->size;
+  for (int i = 0; i < b->n_gives; i++) {
+    if (end - p < (ptrdiff_t)sizeof(struct batch_give)) return -1;
+    const struct batch_give *g = (const struct batch_give*) p;
+    if (end - g->block_bytes < g->size) return -1;
+    if (0 != stage_block(s, g->block_bytes, g->size, g->hops)) return -1;
+    p = g->block_bytes + g->size;
+  }
+  ESP_LOGI(TAG, "Batch in, wants: %i, gives: %i, backlog: %i, ack: %i", b->n_wants, b->n_gives, b->backlog, b->ack);
   return 0;
 }
 
+/* Packs block as batch_give, 0 when not found, -1 when it does not fit.
+ * Caller holds pr_sync_hold(), iter.block may point into flash */
+static int give_block(uint8_t *dst, size_t space, const uint8_t *hash) {
+  int n = 0;
+  pr_iterator_t iter{};
+  if (0 <= pr_find_by_hash(&iter, hash)) {
+    const size_t block_size = pf_sizeof(iter.block);
+    /* would never fit a frame, dropped instead of stalling the batch */
+    if (CANONICAL != pf_typeof(iter.block) || block_size > MAX_FRAME_SIZE - sizeof(struct batch_header) - sizeof(struct batch_give)) {
+      ESP_LOGE(TAG, "Refusing to give corrupt block " HASHSTR, HASH2STR(hash));
+    } else if (sizeof(struct batch_give) + block_size > space) n = -1;
+    else {
+      struct batch_give *g = (struct batch_give*) dst;
+      g->hops = iter.meta.hops;
+      g->size = block_size;
+      memcpy(g->block_bytes, iter.block, block_size);
+      pr_decay(iter.slot, iter.meta.hash, 1);
+      n = sizeof(struct batch_give) + block_size;
+    }
+  } else ESP_LOGW(TAG, "Couldn't resolve requested block");
+  pr_iter_deinit(&iter);
+  return n;
+}
+
+/* Fills buffer with a batch of wants taken from wants, then
+ * blocks from gives while they fit, only acks when out of credit.
+ * Returns frame size or 0 when there is nothing to say */
+static uint32_t fill_batch(struct recon_session *s, std::vector<std::string> &wants, size_t max_wants, std::vector<std::string> &gives) {
+  struct batch_header *b = (struct batch_header*) s->buffer;
+  b->type = T_BATCH;
+  b->n_wants = 0;
+  b->n_gives = 0;
+  b->ack = s->unacked;
+  if (!s->credit) max_wants = 0;
+  uint8_t *p = b->wants;
+  while (b->n_wants < max_wants && !wants.empty()) {
+    memcpy(p, wants.back().data(), ID_SIZE);
+    p += ID_SIZE;
+    wants.pop_back();
+    b->n_wants++;
+  }
+  pr_sync_hold(); /* see on_block_evicted() */
+  while (s->credit && !gives.empty() && b->n_gives < UINT8_MAX) {
+    int n = give_block(p, s->buffer + MAX_FRAME_SIZE - p, (const uint8_t*)gives.back().data());
+    if (n < 0) break; /* next frame */
+    p += n;
+    b->n_gives += n > 0;
+    gives.pop_back();
+  }
+  b->backlog = std::min(gives.size(), (size_t)UINT8_MAX);
+  pr_sync_release();
+  if (b->n_wants || b->n_gives) {
+    s->credit--;
+    s->inflight[(s->inflight_head + s->inflight_n++) % RECON_WINDOW] = b->n_wants;
+    s->wants_in_flight += b->n_wants;
+  } else if (!b->ack) return 0;
+  s->unacked = 0;
+  ESP_LOGI(TAG, "Batch out, wants: %i, gives: %i, backlog: %i, ack: %i", b->n_wants, b->n_gives, b->backlog, b->ack);
+  return p - s->buffer;
+}
+
+/* PW_REPLY_MORE after batches that cost a credit, pure acks end the burst */
+static pwire_ret_t send_batch(pwire_event_t *ev, uint32_t size) {
+  struct recon_session *s = (struct recon_session*) ev->session;
+  if (!size) return PW_NOOP;
+  const struct batch_header *b = (const struct batch_header*) s->buffer;
+  ev->message = s->buffer;
+  ev->size = size;
+  return b->n_wants || b->n_gives ? PW_REPLY_MORE : PW_REPLY;
+}
+
 static uint16_t resolve_requested_block(struct exchange_packet *out, const uint8_t *hash) {
-  uint16_t block_size = 0;
+  size_t block_size = 0;
   pr_iterator_t iter{};
-  while (!pr_iter_next(&iter)) {
-    if (0 != memcmp(iter.meta.hash, hash, ID_SIZE)) continue;
-    out->offer_hops = iter.meta.hops;
+  pr_sync_hold(); /* iter.block may point into flash, keep it from being recycled */
+  if (0 <= pr_find_by_hash(&iter, hash)) {
     block_size = pf_sizeof(iter.block);
-    memcpy(out->block_bytes, iter.block, block_size); /* TODO: boundary check? */
-    out->type |= T_GIVE_SET;
-    // TODO: pr_decay(iter.slot_idx, 1);
-    break;
+    if (CANONICAL != pf_typeof(iter.block) || block_size > MAX_FRAME_SIZE - sizeof(struct exchange_packet)) {
+      ESP_LOGE(TAG, "Refusing to give corrupt block " HASHSTR, HASH2STR(hash));
+      block_size = 0;
+    } else {
+      out->offer_hops = iter.meta.hops;
+      memcpy(out->block_bytes, iter.block, block_size);
+      out->type |= T_GIVE_SET;
+      pr_decay(iter.slot, iter.meta.hash, 1);
+    }
   }
+  pr_sync_release();
   pr_iter_deinit(&iter);
-  if (!(out->type & T_GIVE_SET)) {
-    ESP_LOGW(TAG, "Couldn't resolve requested block");
-    // storage.erase(0, hash); // TODO: implement
-  }
+  /* evicted blocks leave the sync index, peers asking anyway are behind */
+  if (!(out->type & T_GIVE_SET)) ESP_LOGW(TAG, "Couldn't resolve requested block");
   return block_size;
 }
 
+/* Offers (initiator) or agrees on (non-initiator) the window, see RECON_WINDOW */
+static pwire_ret_t send_hello(pwire_event_t *ev) {
+  struct recon_session *s = (struct recon_session*) ev->session;
+  struct exchange_packet *x = (struct exchange_packet*) s->buffer;
+  memset(x, 0, sizeof(struct exchange_packet));
+  x->type = T_EXCHANGE | T_HELLO;
+  x->want[0] = ev->initiator ? RECON_WINDOW : s->window;
+  s->hello = ev->initiator ? HELLO_SENT : HELLO_DONE;
+  ev->message = s->buffer;
+  ev->size = sizeof(struct exchange_packet);
+  return PW_REPLY;
+}
+
+/* Baseline peers, each round trip gives and requests 1 block */
+static pwire_ret_t legacy_exchange(pwire_event_t *ev) {
+  struct recon_session *s = (struct recon_session*) ev->session;
+  struct exchange_packet *x = (struct exchange_packet*) s->buffer;
+  memset(x, 0, sizeof(struct exchange_packet));
+  x->type = T_EXCHANGE;
+
+  if (!s->need.empty()) {
+    auto& hash = s->need.back();
+    ESP_LOGI(TAG, "NEED <-- " HASHSTR, HASH2STR(hash.data()));
+    memcpy(x->want, hash.data(), ID_SIZE);
+    x->type |= T_WANT_SET;
+    s->need.pop_back();
+  }
+
+  int block_size = 0;
+  if (!s->have.empty()) {
+    auto& hash = s->have.back();
+    ESP_LOGI(TAG, "HAVE --> " HASHSTR, HASH2STR(hash.data()));
+    pr_sync_hold(); /* see on_block_evicted() */
+    block_size = resolve_requested_block(x, (const uint8_t*)hash.data());
+    s->have.pop_back();
+    pr_sync_release();
+  }
+
+  ev->size = sizeof(struct exchange_packet) + block_size;
+  ev->message = s->buffer;
+  return PW_REPLY;
+}
+
+static pwire_ret_t initiator_send(pwire_event_t *ev) {
+  struct recon_session *s = (struct recon_session*) ev->session;
+  /* Prepare outgoing data, exchange is done once all batches are acked */
+  if (s->have.empty() && s->need.empty() && !s->remote_backlog && s->credit == s->window) {
+    /* We're in sync, and have/need should be satisfied, bye! */
+    if (!s->reply.has_value()) {
+      ESP_LOGI(TAG, "All empty, no reply, recon exit.");
+      return PW_CLOSE;
+    }
+    /* ask for more if we're empty */
+    std::string msg = s->reply.value();
+    ESP_LOGI(TAG, "Recon continues %zu", msg.size());
+    s->buffer[0] = T_RECONCILE;
+    memcpy(s->buffer + 1, msg.data(), msg.size());
+    ev->message = s->buffer;
+    ev->size = msg.length() + 1;
+    return PW_REPLY;
+  }
+  if (s->hello == HELLO_UNSENT) return send_hello(ev);
+  if (!s->batched) return legacy_exchange(ev);
+
+  /* Batch of wants & blocks, wants are capped by what the peer can queue */
+  const int max_wants = std::max(0, std::min(BATCH_MAX_WANTS, BACKLOG_MAX - s->remote_backlog - s->wants_in_flight));
+  return send_batch(ev, fill_batch(s, s->need, max_wants, s->have));
+}
+
+static pwire_ret_t responder_send(pwire_event_t *ev) {
+  struct recon_session *s = (struct recon_session*) ev->session;
+  /* non-initiator gives what was asked for, wants nothing */
+  std::vector<std::string> none;
+  return send_batch(ev, fill_batch(s, none, 0, s->wanted));
+}
+
+/* The sync index only covers flash, blocks already in the cold tier
+ * would be asked for again every session */
+static void drop_stored(std::vector<std::string> &need) {
+  need.erase(std::remove_if(need.begin(), need.end(), [](const std::string &hash) {
+    pr_iterator_t iter{};
+    iter.mode = PR_ITER_HEADERS;
+    const int found = pr_find_by_hash(&iter, (const uint8_t*)hash.data());
+    pr_iter_deinit(&iter);
+    return found >= 0;
+  }), need.end());
+}
 
 static pwire_ret_t initiator_ondata(pwire_event_t *ev) {
+  struct recon_session *s = (struct recon_session*) ev->session;
   uint8_t type = ev->message[0];
   /* TODO: validate in order RECONCILE / EXCHANGE messaging */
   /*if (type == T_RECONCILE && last_msg != T_RECONCILE) {
@@ -137,62 +512,40 @@ static pwire_ret_t initiator_ondata(pwire_event_t *ev) {
 
   /* Process incoming data */
   if (type == T_RECONCILE) { /* We sent an T_RECONCILE msg during open, expect T_RECONCILE msg */
+    window_reset(s, s->window);
     std::string_view msg(reinterpret_cast<const char*>(ev->message + 1), ev->size - 1);
-    reply = ne->reconcile(msg, have, need);
-    ESP_LOGI(TAG, "INIT RECON_RSP - mlen: %i, have: %i, need: %i", msg.size(), have.size(), need.size());
+    pr_sync_hold();
+    s->reply = s->ne->reconcile(msg, s->have, s->need);
+    pr_sync_release();
+    drop_stored(s->need);
+    ESP_LOGI(TAG, "INIT RECON_RSP - mlen: %i, have: %i, need: %i", msg.size(), s->have.size(), s->need.size());
+  } else if (type == T_BATCH) {
+    if (0 != drain_batch(ev, NULL)) { /* Initiator does not process wants */
+      ESP_LOGE(TAG, "I: Connection dropped, malformed batch");
+      return PW_CLOSE;
+    }
   } else if ((type & 0b11) == T_EXCHANGE){
+    if (s->hello == HELLO_SENT) { /* baseline peers answer without T_HELLO */
+      const struct exchange_packet *x = (const struct exchange_packet*) ev->message;
+      s->batched = type & T_HELLO && ev->size >= sizeof(struct exchange_packet);
+      window_reset(s, s->batched ? x->want[0] : 1);
+      s->hello = HELLO_DONE;
+      ESP_LOGI(TAG, "Peer batches: %i, window: %i", s->batched, s->window);
+    }
     accept_incoming_block(ev);
     /* Initiator does not process T_WANT_SET */
   } else {
     ESP_LOGE(TAG, "I: Connection dropped, unknown type %i", type);
     return PW_CLOSE;
   }
-
-  /* Prepare outgoing data */
-  if (have.empty() && need.empty()) {
-    /* We're in sync, and have/need should be satisfied, bye! */
-    if (!reply.has_value()) {
-      ESP_LOGI(TAG, "All empty, no reply, recon exit.");
-      return PW_CLOSE;
-    }
-    /* ask for more if we're empty */
-    std::string msg = reply.value();
-    ESP_LOGI(TAG, "Recon continues %zu", msg.size());
-    buffer[0] = T_RECONCILE;
-    memcpy(buffer + 1, msg.data(), msg.size());
-    ev->message = buffer;
-    ev->size = msg.length() + 1;
-    return PW_REPLY;
-  }
-
-  /* Define an exchange message, each roundtrip gives and requests 1 block. */
-  struct exchange_packet *x = (struct exchange_packet*) buffer;
-  memset(x, 0, sizeof(struct exchange_packet));
-  x->type = T_EXCHANGE;
-
-  if (!need.empty()) {
-    auto& hash = need.back();
-    ESP_LOGI(TAG, "NEED <-- " HASHSTR, HASH2STR(hash.data()));
-    memcpy(x->want, hash.data(), ID_SIZE);
-    x->type |= T_WANT_SET;
-    need.pop_back();
-  }
-
-  int block_size = 0;
-  if (!have.empty()) {
-    auto& hash = have.back();
-    ESP_LOGI(TAG, "HAVE --> " HASHSTR, HASH2STR(hash.data()));
-    block_size = resolve_requested_block(x, (const uint8_t*)hash.data());
-    have.pop_back();
-  }
-
-  ev->size = sizeof(struct exchange_packet) + block_size;
-  ev->message = buffer;
-  return PW_REPLY;
+  return initiator_send(ev);
 }
 
 static pwire_ret_t recon_ondata(pwire_event_t *ev) {
   ESP_LOGI(TAG, "pwire_data initiator: %i, msg-length: %" PRIu32, ev->initiator, ev->size);
+  struct recon_session *s = (struct recon_session*) ev->session;
+  /* Transport pulls pipelined batches */
+  if (ev->message == NULL) return ev->initiator ? initiator_send(ev) : responder_send(ev);
   if (!ev->size) return PW_CLOSE;
   /* Fork-off into initiator handler */
   if (ev->initiator) return initiator_ondata(ev);
@@ -200,24 +553,38 @@ static pwire_ret_t recon_ondata(pwire_event_t *ev) {
   /* Proceed as non-initiator */
   uint8_t type = ev->message[0];
   if (type == T_RECONCILE) {
+    window_reset(s, s->window);
     std::string_view msg(reinterpret_cast<const char*>(ev->message + 1), ev->size - 1);
-    std::string reply = ne->reconcile(msg);
+    pr_sync_hold();
+    std::string reply = s->ne->reconcile(msg);
+    pr_sync_release();
     // if (reply.empty()) ESP_LOGI(TAG, "ngn_reconcile(I%i): reconcilliation complete?", ev->initiator);
     // return PW_CLOSE; // Hang-on, client decides when done right?
-    ESP_LOGI(TAG, "ngn_reconcile(I%i) reply: %zu", ev->initiator, reply.length());
-    buffer[0] = T_RECONCILE;
-    memcpy(buffer + 1, reply.data(), reply.length());
-    ev->message = buffer;
+    ESP_LOGI(TAG, "ngn_reconcile(I%i) reply: %zu, window: %i", ev->initiator, reply.length(), s->window);
+    s->buffer[0] = T_RECONCILE;
+    memcpy(s->buffer + 1, reply.data(), reply.length());
+    ev->message = s->buffer;
     ev->size = reply.length() + 1;
     return PW_REPLY;
+  } else if (type == T_BATCH) {
+    if (0 != drain_batch(ev, &s->wanted)) {
+      ESP_LOGE(TAG, "S: Connection dropped, malformed batch");
+      return PW_CLOSE;
+    }
+    return responder_send(ev);
   } else if ((type & 0b11) != T_EXCHANGE) {
     ESP_LOGE(TAG, "S: Connection dropped, unknown type %i", type);
     return PW_CLOSE;
+  } else if (type & T_HELLO) { /* agree on the smaller window */
+    if (ev->size < sizeof(struct exchange_packet)) return PW_CLOSE;
+    window_reset(s, ((const struct exchange_packet*) ev->message)->want[0]);
+    s->batched = 1;
+    return send_hello(ev);
   }
 
   accept_incoming_block(ev); // TODO: don't ignore error?
 
-  struct exchange_packet *x_out = (struct exchange_packet*) buffer;
+  struct exchange_packet *x_out = (struct exchange_packet*) s->buffer;
   memset(x_out, 0, sizeof(struct exchange_packet));
   x_out->type = T_EXCHANGE; // Server always replies with T_EXCHANGE even when empty.
   int block_size = 0;
@@ -229,19 +596,25 @@ static pwire_ret_t recon_ondata(pwire_event_t *ev) {
   }
 
   ev->size = sizeof(struct exchange_packet) + block_size;
-  ev->message = buffer;
+  ev->message = s->buffer;
   return PW_REPLY;
 }
 
 static void recon_onclose(pwire_event_t *ev) {
   ESP_LOGI(TAG, "pwire_onclose initiator: %i", ev->initiator);
-  if (buffer == NULL) {
-    ESP_LOGE(TAG, "expected memory is gone");
-    abort();
-  }
-  free(buffer);
-  buffer = NULL;
-  delete ne;
+  struct recon_session *s = (struct recon_session*) ev->session;
+  if (s == NULL) return; /* never opened */
+  pr_sync_hold();
+  struct recon_session **p = &sessions;
+  while (*p != s) p = &(*p)->next;
+  *p = s->next;
+  pr_sync_release();
+  flush_staged_blocks(s);
+  pr_cache_stats_t cs;
+  pr_cache_stats(&cs);
+  ESP_LOGI(TAG, "Block cache hits: %" PRIu32 ", misses: %" PRIu32 ", %zu/%zu bytes", cs.hits, cs.misses, cs.bytes, cs.budget);
+  session_free(s);
+  ev->session = NULL;
 }
 
 pwire_handlers_t wire_io = {
@@ -251,27 +624,12 @@ pwire_handlers_t wire_io = {
 };
 
 pwire_handlers_t *recon_init_io() {
-  /* Build in-mem index of all blocks on boot */
-  ESP_LOGI(TAG, "Indexing block repo...");
+  /* Sync index is kept by the repo, only catch up on time */
+  pr_set_evict_handler(on_block_evicted);
   pr_iterator_t iter{};
-  int i = 0;
-  uint64_t latest_block_time = 0;
-  while (!pr_iter_next(&iter)) {
-    if (iter.meta.hops >= PR_MAX_HOPS) continue;
-    uint64_t btime = pf_read_utc(iter.block->net.date);
-    storage.insert(btime, std::string_view((const char*)iter.meta.hash, 32));
-    if (latest_block_time < btime) latest_block_time = btime;
-    // ---
-    int bsize = pf_block_body_size(iter.block);
-    char *txt = (char*)calloc(1, bsize + 1);
-    memcpy(txt, pf_block_body(iter.block), bsize);
-    ESP_LOGI(TAG, "Slot%i: body: %s, "HASHSTR, i, txt, HASH2STR(iter.meta.hash));
-    free(txt);
-    ++i;
-  };
-  bump_time(latest_block_time);
-
-  ESP_LOGI(TAG, "Done! %i blocks discovered, current_time: %"PRIu64, i, time(NULL));
+  iter.mode = PR_ITER_HEADERS;
+  if (!pr_iter_by_date(&iter, 0, UINT64_MAX, 1)) bump_time(pf_read_utc(iter.block->net.date)); /* newest */
   pr_iter_deinit(&iter);
+  ESP_LOGI(TAG, "%zu blocks to sync, current_time: %"PRIu64, pr_sync_size(), time(NULL));
   return &wire_io;
 }
@@ -4,6 +4,7 @@
 #include "picofeed.h"
 
 #define PR_MAX_HOPS 50
+#define PR_COLD_SLOT 0x10000 /* slot-ids from here on are records in the cold tier */
 /****
  *
  * Soul successor to pico-repo operating over NAND-flash
@@ -12,7 +13,9 @@
 typedef enum {
   PR_ERROR_UNSUPPORTED_BLOCK_TYPE = -1,
   PR_ERROR_INVALID_BLOCK = -2,
-  PR_ERROR_BLOCK_TOO_LARGE = -3
+  PR_ERROR_BLOCK_TOO_LARGE = -3,
+  PR_ERROR_DUPLICATE = -4, /* block already stored */
+  PR_ERROR_NO_SPACE = -5
 } pr_error_t;
 
 /* Block metadata */
@@ -24,12 +27,24 @@ typedef struct {
   const uint8_t *hash;
 } pr_metadata_t;
 typedef struct flash_slot flash_slot_t;
+
+typedef enum {
+  PR_ITER_FULL = 0, /* reads entire slot */
+  PR_ITER_HEADERS = 1 /* reads slot + block headers, see pr_iter_load_body() */
+} pr_iter_mode_t;
+
 typedef struct {
   int start;
   int offset;
+  pr_iter_mode_t mode;
+  int slot; /* current slot-id */
   pr_metadata_t meta;
+  /* points straight into flash when mapped, a racing recycle may erase it:
+   * hold pr_sync_hold() from lookup until done with block & meta.hash */
   const pf_block_t *block;
   flash_slot_t *_tmp;
+  int body_loaded;
+  uint64_t _date; /* pr_iter_by_date() cursor */
 } pr_iterator_t;
 
 typedef struct pr_internal pr_internal;
@@ -43,10 +58,80 @@ void pr_deinit();
  * Must call pr_iter_deinit(iter) once done.
  * @param repo Initalized repository
  * @param iter Empty iterator, modify iter.start to begin from a different index
- * @return 0: not done, -1: done, empty space reached, 1: done - looped back to starting offset.
+ * set iter.mode = PR_ITER_HEADERS to skip reading block bodies.
+ * @return 0: not done, 1: done - looped back to starting offset.
  */
 int pr_iter_next (pr_iterator_t *iter);
 
+/**
+ * @brief Iterate blocks ordered by block date using the in-RAM time index,
+ * flash is only read for the visited blocks.
+ * Must call pr_iter_deinit(iter) once done.
+ * @param iter Empty iterator, iter.mode is respected.
+ * @param from utc millis, inclusive
+ * @param to utc millis, exclusive
+ * @param newest_first iterate backwards
+ * @return 0: not done, 1: done
+ */
+int pr_iter_by_date(pr_iterator_t *iter, uint64_t from, uint64_t to, int newest_first);
+
+/**
+ * @brief Iterate blocks of one author using the in-RAM author index,
+ * newest written first. Writes between steps may end iteration early.
+ * Must call pr_iter_deinit(iter) once done.
+ * @param iter Empty iterator, iter.mode is respected.
+ * @param author 32 bytes public key
+ * @return 0: not done, 1: done
+ */
+int pr_iter_by_author(pr_iterator_t *iter, const uint8_t *author);
+
+/**
+ * @brief Iterate blocks in the cold tier in card order,
+ * iter.slot is >= PR_COLD_SLOT. Must call pr_iter_deinit(iter) once done.
+ * @param iter Empty iterator, iter.mode is respected.
+ * @return 0: not done, 1: done or no cold tier attached
+ */
+int pr_iter_cold(pr_iterator_t *iter);
+
+typedef struct pr_scan pr_scan_t;
+#define PR_SCAN_DEPTH 3 /* sector buffers, 4KiB each */
+
+/**
+ * @brief Sequential scan over all records for index rebuilds,
+ * GC and integrity checks. A reader task prefetches the next
+ * depth - 1 sectors while the caller works on the current one.
+ * Must call pr_scan_close(scan) once done.
+ * @param depth number of sector buffers, >= 2
+ */
+pr_scan_t *pr_scan_open(int depth);
+
+/**
+ * @brief Positions iter on next record, block & body are valid
+ * until the next call, iter needs no pr_iter_deinit().
+ * @return 0: not done, 1: done
+ */
+int pr_scan_next(pr_scan_t *scan, pr_iterator_t *iter);
+
+/**
+ * @brief Stops reader task and frees buffers, may be called before done.
+ */
+void pr_scan_close(pr_scan_t *scan);
+
+/**
+ * @brief Integrity check, rehashes every record in flash over a scan.
+ * Corrupt records are entombed like pr_delete_block() so pr_compact()
+ * can reclaim their sectors.
+ * @return number of corrupt records found
+ */
+int pr_verify(void);
+
+/**
+ * @brief Fetches block body of current slot when iterating
+ * in PR_ITER_HEADERS mode, noop in PR_ITER_FULL mode.
+ * @return block or NULL when iterator is not positioned on a block.
+ */
+const pf_block_t *pr_iter_load_body(pr_iterator_t *iter);
+
 /**
  * @brief Iterators must be deinitalized
  * Will be redesigned later
@@ -61,18 +146,178 @@ void pr_iter_deinit(pr_iterator_t *iter);
  */
 int pr_write_block (const uint8_t *block_bytes, uint8_t n_hops);
 
+typedef struct {
+  const uint8_t *block_bytes;
+  uint8_t hops; /* number of hops as received over wire */
+  int result; /* out: slot-id or pr_error_t when < 0 */
+  uint8_t hash[32]; /* out: blake2b of block */
+} pr_write_req_t;
+
+/**
+ * @brief Writes a batch of blocks to storage.
+ * Placement is planned for the entire batch so each
+ * affected sector is erased at most once and written sequentially.
+ * Blocks already in storage are rejected with PR_ERROR_DUPLICATE
+ * before their signature is verified.
+ * @param reqs blocks to write, result is set per request.
+ * @param n number of requests
+ * @return number of blocks stored
+ */
+int pr_write_blocks (pr_write_req_t *reqs, int n);
+
 int read_block_size (uint8_t id[32]);
 int read_block (pico_signature_t id);
 
 /**
- * Deletes everything
+ * Deletes everything in flash, the cold tier is kept
  */
 void pr_purge_flash();
 
 /**
- * @brief Stops iterator when hash found
- * @param iter Needs to be deinit() when done.
+ * @brief Looks up block by hash using the in-RAM index,
+ * costs a single slot read on hit, none when the block is cached.
+ * Misses fall through to the cold tier.
+ * @param iter Positioned on found block, needs to be deinit() when done.
  * @param hash 32 bytes Blake2b
+ * @return slot-id or -1 when not found
+ */
+int pr_find_by_hash(pr_iterator_t *iter, const uint8_t *hash);
+
+/**
+ * @brief Counts n shares of block in slot, decay is updated in place
+ * without erase. Most shared sectors are recycled first.
+ * @param slot_idx slot-id as returned by pr_write_block() / iterator
+ * @param hash 32 bytes, the slot may have been recycled since lookup
+ * @param n number of times block was given to peers
+ * @return total shares (meta.decay) or -1 when slot no longer holds hash
+ */
+int pr_decay(int slot_idx, const uint8_t *hash, int n);
+/**
+ * @brief Marks block as deleted, flash is not erased
+ * until the sector is reclaimed by pr_compact().
+ * @param hash 32 bytes Blake2b
+ * @return former slot-id or -1 when not found
+ */
+int pr_delete_block(const uint8_t *hash);
+
+/**
+ * @brief Erases sectors that hold only deleted blocks so later writes
+ * find erased space. Slow, call when idle.
+ * @param max_sectors upper bound of sectors to erase
+ * @return number of sectors erased
+ */
+int pr_compact(int max_sectors);
+
+#define PR_WEAR_BINS 16
+typedef struct {
+  uint32_t min_erases;
+  uint32_t max_erases;
+  uint32_t total_erases;
+  uint32_t bin_width; /* bins[0] starts at min_erases */
+  uint16_t bins[PR_WEAR_BINS]; /* number of sectors per bin */
+} pr_wear_t;
+
+/**
+ * @brief Erase count histogram over all data sectors,
+ * counters persist across reboots.
+ */
+void pr_wear_stats(pr_wear_t *wear);
+
+/**
+ * @brief Persists a compact copy of the in-RAM indices so the
+ * next pr_init() only rescans sectors written since.
+ * Alternates between two regions and blocks writers while it runs,
+ * skipped until enough writes & recycles piled up to be worth the
+ * erase. Call now and then when idle.
+ * @return 1 when written, 0 when close enough to up to date
+ */
+int pr_checkpoint(void);
+
+typedef struct {
+  uint32_t hits;
+  uint32_t misses;
+  uint32_t entries;
+  size_t bytes; /* cached block bytes */
+  size_t budget; /* taken from free heap or PSRAM by pr_init() */
+} pr_cache_stats_t;
+
+/**
+ * @brief Counters of the block cache behind pr_find_by_hash(),
+ * written blocks go into it as well.
+ */
+void pr_cache_stats(pr_cache_stats_t *stats);
+
+/**
+ * Sync index, the set offered to reconciliation:
+ * blocks in flash with hops < PR_MAX_HOPS ordered by (date, hash),
+ * the order negentropy expects. Kept up to date by writes & recycling
+ * and persisted by pr_checkpoint(), so nothing is built on boot.
+ * Positions shift as blocks come and go, see pr_sync_hold().
+ */
+typedef struct {
+  uint64_t date; /* block date, utc millis */
+  uint8_t hash[32];
+} pr_sync_item_t;
+
+/**
+ * @brief Number of blocks in the sync index
+ */
+size_t pr_sync_size(void);
+
+/**
+ * @brief Reads n items starting at position begin
+ * @return number of items read
+ */
+size_t pr_sync_read(size_t begin, size_t n, pr_sync_item_t *items);
+
+/**
+ * @brief First position in [first, last) holding (date, hash) or greater
+ * @param hash 32 bytes, zero padded when shorter
+ */
+size_t pr_sync_lower_bound(size_t first, size_t last, uint64_t date, const uint8_t *hash);
+
+/**
+ * @brief Sum of hashes in [begin, end) as 256-bit little endian
+ * integer, the same as negentropy's Accumulator.
+ * Costs a few reads at the edges, whole chunks are precomputed.
+ * @param sum 32 bytes
+ */
+void pr_sync_sum(size_t begin, size_t end, uint8_t *sum);
+
+/**
+ * @brief Holds writers & recycling off so positions stay put,
+ * wrap each reconcile() call. Calls nest, release as often as held.
+ */
+void pr_sync_hold(void);
+void pr_sync_release(void);
+
+/**
+ * Called for every block that is gone for good: recycled with no
+ * cold tier to take it, evicted from a full cold tier or deleted.
+ * Runs in the task that caused it with the repo locked,
+ * pr_sync_hold() keeps it out. Don't write blocks from within.
+ */
+typedef void (*pr_evict_handler_t)(const uint8_t *hash);
+
+/**
+ * @brief Sets the one evict handler, NULL to unset
+ */
+void pr_set_evict_handler(pr_evict_handler_t handler);
+
+/**
+ * @brief Attaches SD-card store as cold tier, see store.h
+ * Recycled sectors have their blocks migrated instead of dropped
+ * and lookups, decay & delete fall through to it.
+ * Call after pr_init().
+ * @return 0 or -1 when no card is present
+ */
+int pr_cold_attach(void);
+
+/**
+ * @brief Keeps min_erased sectors in stock by migrating the
+ * next sector in line for recycling (most shared, then oldest)
+ * to the cold tier, so writes rarely pay for migration. Call when idle.
+ * @return 1 when a sector was freed, 0 when nothing to do
  */
-int pr_find_by_hash(pr_iterator_t *iter, uint8_t *hash);
+int pr_cold_migrate(int min_erased);
 #endif
@@ -0,0 +1,65 @@
+#ifndef PR_BACKEND_H
+#define PR_BACKEND_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+/****
+ *
+ * Raw storage underneath the pr_* API.
+ * Backends must behave like NOR-flash, erase sets all bits to 1
+ * and writes can only pull bits 1 -> 0.
+ *
+ *******************/
+typedef struct {
+  size_t size; /* usable bytes */
+  size_t erase_size; /* erase granularity */
+  const uint8_t *mapped; /* read-only view of entire storage, NULL: reads copy */
+} pr_geometry_t;
+
+typedef struct {
+  const char *name;
+  int (*open)(pr_geometry_t *geometry); /* 0 on success */
+  void (*close)(void);
+  esp_err_t (*read)(size_t offset, void *dst, size_t size);
+  esp_err_t (*write)(size_t offset, const void *src, size_t size);
+  esp_err_t (*erase)(size_t offset, size_t size);
+} pr_backend_t;
+
+#if CONFIG_IDF_TARGET_LINUX
+/**
+ * Image file on host, emulates NOR-flash.
+ * Latencies are slept on every call to approximate
+ * real flash when measuring throughput, 0: disabled.
+ * A missing or empty image is created blank, open fails on any other size.
+ */
+typedef struct {
+  const char *path; /* NULL: env PR_HOST_IMAGE or "PiC0.img" */
+  uint32_t write_us; /* per 256 byte program page */
+  uint32_t erase_us; /* per erase sector */
+} pr_posix_config_t;
+
+extern const pr_backend_t pr_backend_posix;
+
+/**
+ * @brief Must be called before pr_init(),
+ * latencies can also be set with env PR_HOST_WRITE_US / PR_HOST_ERASE_US
+ */
+void pr_backend_posix_config(const pr_posix_config_t *config);
+#else
+/* PiC0 data partition, see partitions.csv */
+extern const pr_backend_t pr_backend_esp;
+#endif
+
+/**
+ * @brief Selects storage for the repo, call before pr_init().
+ * Defaults to pr_backend_esp on device and pr_backend_posix on host.
+ */
+void pr_set_backend(const pr_backend_t *backend);
+#ifdef __cplusplus
+}
+#endif
+#endif
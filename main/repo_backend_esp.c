@@ -0,0 +1,86 @@
+#include "repo_backend.h"
+#include "esp_partition.h"
+#include "esp_log.h"
+#include <inttypes.h>
+
+#if !CONFIG_IDF_TARGET_LINUX
+#define ESP_PARTITION_SUBTYPE_DATA_PiC0 87
+#define ESP_PARTITION_LABEL_PiC0 "PiC0"
+
+static const char TAG[] = "repo_esp.c";
+
+static const esp_partition_t *partition = NULL;
+static esp_partition_mmap_handle_t mmap_handle;
+static int mapped = 0;
+
+static int esp_open(pr_geometry_t *geometry) {
+  const esp_partition_t *part = esp_partition_find_first(
+    ESP_PARTITION_TYPE_DATA,
+    ESP_PARTITION_SUBTYPE_DATA_PiC0,
+    ESP_PARTITION_LABEL_PiC0
+  );
+  if (part == NULL) {
+    ESP_LOGE(TAG, "Could not find 'PiC0' partition, t: %i, sub_t: %i, label: %s",
+      ESP_PARTITION_TYPE_DATA,
+      ESP_PARTITION_SUBTYPE_DATA_PiC0,
+      ESP_PARTITION_LABEL_PiC0
+    );
+    return -1;
+  } else {
+    ESP_LOGI(TAG, "Partition Found: %s, type: %i, sub: %i, size: %"PRIu32" @%"PRIu32", erz: %"PRIu32" enc: %i",
+	part->label,
+	part->type,
+	part->subtype,
+	part->size,
+	part->address,
+	part->erase_size,
+	part->encrypted
+    );
+  }
+  partition = part;
+  geometry->size = part->size;
+  geometry->erase_size = part->erase_size;
+
+  const void *ptr = NULL;
+  esp_err_t err = esp_partition_mmap(
+      partition,
+      0,
+      part->size,
+      ESP_PARTITION_MMAP_DATA,
+      &ptr,
+      &mmap_handle
+  );
+  /* Survivable, reads fall back to copying */
+  if (err != ESP_OK) ESP_LOGW(TAG, "esp_partition_mmap() failed: %s, using copying reads", esp_err_to_name(err));
+  mapped = err == ESP_OK;
+  geometry->mapped = mapped ? ptr : NULL;
+  return 0;
+}
+
+static void esp_close(void) {
+  if (mapped) esp_partition_munmap(mmap_handle);
+  mapped = 0;
+  partition = NULL;
+}
+
+static esp_err_t esp_read(size_t offset, void *dst, size_t size) {
+  return esp_partition_read(partition, offset, dst, size);
+}
+
+static esp_err_t esp_write(size_t offset, const void *src, size_t size) {
+  return esp_partition_write(partition, offset, src, size);
+}
+
+static esp_err_t esp_erase(size_t offset, size_t size) {
+  return esp_partition_erase_range(partition, offset, size);
+}
+
+const pr_backend_t pr_backend_esp = {
+  .name = "esp_partition",
+  .open = esp_open,
+  .close = esp_close,
+  .read = esp_read,
+  .write = esp_write,
+  .erase = esp_erase
+};
+#endif
@@ -0,0 +1,118 @@
+#include "repo_backend.h"
+#include "esp_log.h"
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#if CONFIG_IDF_TARGET_LINUX
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifndef PR_HOST_IMAGE
+#define PR_HOST_IMAGE "PiC0.img"
+#endif
+#define HOST_SIZE 0x200000 /* matches PiC0 in partitions.csv */
+#define HOST_ERASE_SIZE 4096
+#define HOST_PROGRAM_PAGE 256
+
+static const char TAG[] = "repo_posix.c";
+
+static pr_posix_config_t config = {0};
+static uint8_t *image = NULL;
+static int image_fd = -1;
+
+void pr_backend_posix_config(const pr_posix_config_t *c) {
+  config = *c;
+}
+
+static uint32_t env_u32(const char *name, uint32_t fallback) {
+  const char *v = getenv(name);
+  return v == NULL ? fallback : strtoul(v, NULL, 10);
+}
+
+/* Map image file, created blank (erased) when empty or missing */
+static int posix_open(pr_geometry_t *geometry) {
+  const char *path = config.path;
+  if (path == NULL) path = getenv("PR_HOST_IMAGE");
+  if (path == NULL) path = PR_HOST_IMAGE;
+  config.write_us = env_u32("PR_HOST_WRITE_US", config.write_us);
+  config.erase_us = env_u32("PR_HOST_ERASE_US", config.erase_us);
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    ESP_LOGE(TAG, "Could not open image '%s'", path);
+    return -1;
+  }
+  off_t size = lseek(fd, 0, SEEK_END);
+  if (size == 0) {
+    uint8_t blank[HOST_ERASE_SIZE];
+    memset(blank, 0xff, HOST_ERASE_SIZE);
+    for (int i = 0; i < HOST_SIZE / HOST_ERASE_SIZE; i++) {
+      if (write(fd, blank, HOST_ERASE_SIZE) != HOST_ERASE_SIZE) {
+        ESP_LOGE(TAG, "Could not initialize image '%s'", path);
+        if (ftruncate(fd, 0)) ESP_LOGE(TAG, "ftruncate() of '%s' failed", path);
+        close(fd);
+        return -1;
+      }
+    }
+  } else if (size != HOST_SIZE) {
+    /* Never wipe what might be someone's data, let them remove it */
+    ESP_LOGE(TAG, "Image '%s' is %lld bytes, expected %i", path, (long long)size, HOST_SIZE);
+    close(fd);
+    return -1;
+  }
+  void *ptr = mmap(NULL, HOST_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (ptr == MAP_FAILED) {
+    ESP_LOGE(TAG, "mmap() of '%s' failed", path);
+    close(fd);
+    return -1;
+  }
+  image_fd = fd;
+  image = ptr;
+  geometry->size = HOST_SIZE;
+  geometry->erase_size = HOST_ERASE_SIZE;
+  geometry->mapped = image;
+  ESP_LOGI(TAG, "Image mapped: %s, size: %i, latency w: %"PRIu32"us e: %"PRIu32"us",
+    path, HOST_SIZE, config.write_us, config.erase_us);
+  return 0;
+}
+
+static void posix_close(void) {
+  if (image == NULL) return;
+  munmap(image, HOST_SIZE);
+  close(image_fd);
+  image = NULL;
+  image_fd = -1;
+}
+
+static esp_err_t posix_read(size_t offset, void *dst, size_t size) {
+  if (offset + size > HOST_SIZE) return ESP_ERR_INVALID_SIZE;
+  memcpy(dst, image + offset, size);
+  return ESP_OK;
+}
+
+/* NOR-flash, only pulls bits 1 -> 0 */
+static esp_err_t posix_write(size_t offset, const void *src, size_t size) {
+  if (offset + size > HOST_SIZE) return ESP_ERR_INVALID_SIZE;
+  for (size_t i = 0; i < size; i++) image[offset + i] &= ((const uint8_t*)src)[i];
+  if (config.write_us) usleep(config.write_us * ((size + HOST_PROGRAM_PAGE - 1) / HOST_PROGRAM_PAGE));
+  return ESP_OK;
+}
+
+static esp_err_t posix_erase(size_t offset, size_t size) {
+  if (offset % HOST_ERASE_SIZE || size % HOST_ERASE_SIZE) return ESP_ERR_INVALID_ARG;
+  if (offset + size > HOST_SIZE) return ESP_ERR_INVALID_SIZE;
+  memset(image + offset, 0xff, size);
+  if (config.erase_us) usleep(config.erase_us * (size / HOST_ERASE_SIZE));
+  return ESP_OK;
+}
+
+const pr_backend_t pr_backend_posix = {
+  .name = "posix",
+  .open = posix_open,
+  .close = posix_close,
+  .read = posix_read,
+  .write = posix_write,
+  .erase = posix_erase
+};
+#endif
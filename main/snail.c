@@ -108,19 +108,11 @@ void display_state (struct snail_state* state) {
 #endif
 
 void init_POP01(void) {
-  pr_iterator_t iter = {0};
-  int n_blocks = 0;
-  while (!pr_iter_next(&iter)) {
-    int bsize = pf_block_body_size(iter.block);
-    char *txt = calloc(1, bsize + 1);
-    memcpy(txt, pf_block_body(iter.block), bsize);
-    ESP_LOGI(TAG, "Slot%i: body: %s", n_blocks, txt);
-    free(txt);
-    n_blocks++;
-  }
+  /* Any block will do, one step over the time index */
+  pr_iterator_t iter = { .mode = PR_ITER_HEADERS };
+  int empty = pr_iter_by_date(&iter, 0, UINT64_MAX, 0);
   pr_iter_deinit(&iter);
-  ESP_LOGI(TAG, "init_POP01, %i blocks exist", n_blocks);
-  if (n_blocks > 0) return; // Skip past initial block
+  if (!empty) return; // Skip past initial block
 
 
   /* Does it run?; TODO: call after wifi init */
@@ -142,6 +134,53 @@ void init_POP01(void) {
   }
 }
 
+/* Reclaims deleted blocks while idle so writes don't pay for erase,
+ * once settled the boot index is checkpointed every so often.
+ * Each checkpoint erases flash, so at most once per interval.
+ * Swap cycles NOTIFY <-> SEEK on its own, only peers count as busy */
+#define CKPT_INTERVAL 900 /* seconds between checkpoints */
+#define CKPT_QUIET 30 /* seconds without a peer before checkpointing */
+#define VERIFY_AFTER 120 /* seconds of uptime before the once per boot integrity check */
+static int syncing(void) {
+  return state.status == ATTACH || state.status == INFORM;
+}
+
+static void compact_task(void *arg) {
+  int quiet = 0, verified = 0;
+  int64_t last_ckpt = esp_timer_get_time();
+  while (1) {
+    if (syncing()) {
+      quiet = 0;
+      delay(1000);
+      continue;
+    }
+    if (pr_compact(1)) {
+      delay(50);
+      continue;
+    }
+    quiet++;
+    const int64_t now = esp_timer_get_time();
+    if (quiet >= CKPT_QUIET && now - last_ckpt >= CKPT_INTERVAL * 1000000LL) {
+      pr_checkpoint(); /* noop without enough changes */
+      last_ckpt = now;
+    }
+    if (!verified && now >= VERIFY_AFTER * 1000000LL) { /* uptime, not quiet time */
+      ESP_LOGI(TAG, "Integrity check done, %i corrupt blocks entombed", pr_verify());
+      verified = 1;
+    }
+    delay(1000);
+  }
+}
+
+/* Moves cold blocks to SD ahead of time so writes find erased sectors */
+#define COLD_MIN_ERASED 16
+static void migrate_task(void *arg) {
+  while (1) {
+    if (state.status != NOTIFY || 0 == pr_cold_migrate(COLD_MIN_ERASED)) delay(1000);
+    else delay(50);
+  }
+}
+
 /* The main task drives optional UI
  * and wifi NAN discovery.
  */
@@ -153,7 +192,10 @@ void app_main(void) {
 
   display_state(&state);
   pr_init();
+  int cold = 0 == pr_cold_attach();
   init_POP01();
+  xTaskCreate(compact_task, "repo_compact", 4096, NULL, tskIDLE_PRIORITY + 1, NULL);
+  if (cold) xTaskCreate(migrate_task, "repo_migrate", 3072, NULL, tskIDLE_PRIORITY + 1, NULL);
   pwire_handlers_t *wire_io = recon_init_io();
 #ifdef PROTO_NAN
   nanr_discovery_start(); /* desired but broken */
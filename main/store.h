@@ -1,34 +1,157 @@
+#ifndef STORE_H
+#define STORE_H
 /**
- * THIS FILE IS JUNK ATM.
+ * Raw-sector SD-card engine, no filesystem.
+ * Holds the same blocks as repo.h (errors are pr_error_t)
+ * but scales to the size of the card.
+ *
+ * Not selected in place of the flash engine, the pr_* API reaches
+ * it as cold tier, see pr_cold_attach(). Sync index, time & author
+ * iterators and checkpoints stay with the flash engine, lookups,
+ * decay & delete fall through to the card.
+ *
+ * Space of deleted records is reused, once the card is full
+ * the oldest records are evicted to make room for new ones.
+ * Limits:
+ * - Free space is never merged, a large block may evict
+ *   several small ones before one of them leaves a gap it fits.
+ * - Eviction goes by position on the card, that is write order
+ *   until space is reused, then roughly oldest first.
+ * - Index entries of dropped blocks are only purged from leaves,
+ *   so the index is sized by the most blocks ever held, not by those live.
  */
 
-/* #include "driver/sdspi_host.h" */
 #include <stdint.h>
+#include <stddef.h>
 #include "esp_err.h"
-esp_err_t storage_init(void);
-esp_err_t storage_deinit(void);
+#include "repo.h"
 
 typedef uint8_t public_key_t[32];
 typedef uint8_t block_id_t[64]; /* Synonymous with Signature */
 typedef uint8_t block_hash_t[32];
 
+#define STORE_SECTOR_SIZE 512
+#define STORE_MAX_DATA_SECTORS 8
+#define STORE_MAX_BLOCK_SIZE (STORE_MAX_DATA_SECTORS * STORE_SECTOR_SIZE)
+
+/**
+ * Sector device underneath the engine,
+ * unlike flash sectors can be rewritten in place.
+ */
+typedef struct {
+  const char *name;
+  int (*open)(uint32_t *n_sectors); /* 0 on success */
+  void (*close)(void);
+  esp_err_t (*read)(uint32_t sector, void *dst, size_t count);
+  esp_err_t (*write)(uint32_t sector, const void *src, size_t count);
+} store_device_t;
+
+#if CONFIG_IDF_TARGET_LINUX
+/* Image file on host, env STORE_HOST_IMAGE or "sd0.img" */
+extern const store_device_t store_device_file;
+#define STORE_HOST_SECTORS (64 * 1024) /* 32MiB when created */
+#else
+/* SD-card over SPI, raw sectors */
+extern const store_device_t store_device_sdspi;
+#endif
+
 /**
  * Synonymous with Node.
  * Sector0 contains the block-descriptor
- * Sector1-3 contains actual block
+ * Sector1-8 contains actual block
  */
-struct block_descriptor {
-  uint8_t flags; /* DELETED|LEFT|RIGHT */
-  uint16_t size;
-  uint16_t date;
+struct __attribute__((packed)) block_descriptor {
+  uint8_t glyph; /* DESC_GLYPH, tells records from index nodes */
+  uint8_t flags; /* DESC_DELETED */
+  uint16_t size; /* block size */
+  uint64_t date; /* block date, utc millis */
   uint32_t date_recv; /* Date Received | there is an RTC but no sync */
   uint16_t hops; /* Inverse TTL */
   public_key_t author;
   block_id_t id; /* PicoBlocks use a non-malleable Signature as BlockID, not hash */
-  block_id_t parentId; /* PicoDAG parent. unrelated to storage nodes. */
-  uint32_t children[2]; /* Sector ptr */
-}; /* 512-(16+16+32+16+32+64+64) = 144bytes left for indexing */
+  /* index data */
+  block_hash_t hash; /* blake2b, same as repo */
+  uint8_t shares; /* N-times given to peers */
+};
+
+typedef struct {
+  uint8_t hops;
+  uint8_t shares;
+  uint64_t date; /* block date */
+  block_hash_t hash;
+} store_meta_t;
+
+/**
+ * @brief Opens device and loads superblock,
+ * formats device when no superblock is found.
+ * @param device NULL: default device for target
+ */
+esp_err_t storage_init(const store_device_t *device);
+esp_err_t storage_deinit(void);
+
+/**
+ * @brief Writes block to card and indexes it by id and hash.
+ * @return record (sector of descriptor) or pr_error_t when result is < 0
+ */
+int store_write_block(const uint8_t *block_bytes, uint8_t hops);
+
+/**
+ * @brief Writes block that was already verified by the repo,
+ * keeps its hash and share count. Used by the cold tier.
+ * @return record or pr_error_t when result is < 0
+ */
+int store_import_block(const uint8_t *block_bytes, const store_meta_t *meta);
+
+/**
+ * @brief B-tree lookup, O(log n) sector reads
+ * @return record or -1 when not found
+ */
+int store_find_by_id(const uint8_t *id);
+int store_find_by_hash(const uint8_t *hash);
+
+/**
+ * @brief Reads block of record, or only its first max bytes.
+ * @param dst NULL to only read meta
+ * @param max size of dst, STORE_MAX_BLOCK_SIZE holds any block
+ * @param meta optional
+ * @return full block size or -1
+ */
+int store_read_block(int record, uint8_t *dst, size_t max, store_meta_t *meta);
 
+/**
+ * @brief Deletes record, its space is reused by later writes.
+ * @return 0 or -1 when record was not live
+ */
+int store_delete_block(int record);
+
+/**
+ * @brief Counts n shares of record, see pr_decay()
+ * @return total shares or -1 when record does not hold hash
+ */
+int store_decay(int record, const uint8_t *hash, int n);
+
+/**
+ * @brief Walks all live records in the order they sit on the card.
+ * @param cursor 0 to start, advanced on each call
+ * @return record or 0 when done
+ */
+int store_iter_next(uint32_t *cursor);
+
+/**
+ * @brief Number of live blocks
+ */
+int store_list_blocks(void);
+
+/**
+ * Called for every record evicted to make room, from within
+ * the write that needed it with the store locked.
+ */
+typedef void (*store_evict_handler_t)(const uint8_t *hash);
+
+/**
+ * @brief Sets the one evict handler, NULL to unset
+ */
+void store_set_evict_handler(store_evict_handler_t handler);
 
 /**
  * Wishlist:
@@ -66,4 +189,4 @@ struct block_descriptor {
  * Good news is that we have about 1-2MB free builtin flash for storage in the prototype.
  * So external memory is not required.
  */
-int store_list_blocks();
+#endif
@@ -1,9 +1,22 @@
 #include "store.h"
-#include "esp_vfs_fat.h"
-#include "sdmmc_cmd.h"
+#include "esp_log.h"
+#include "picofeed.h"
+#include "monocypher.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <time.h>
+
+#if CONFIG_IDF_TARGET_LINUX
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include "driver/sdspi_host.h"
 #include "driver/spi_common.h"
 #include "sdmmc_cmd.h"
-#include <dirent.h>
 
 #define SDMODE_SPI
 #ifdef SDMODE_SPI
@@ -12,15 +25,618 @@
 #define SD_MOSI GPIO_NUM_23
 #define SD_CS GPIO_NUM_33
 #endif
+#endif
 
-
-#define MOUNT_POINT "/sd0"
 static const char TAG[] = "store.c";
-static const char mount_point[] = MOUNT_POINT;
-sdmmc_host_t host = SDSPI_HOST_DEFAULT();
-sdmmc_card_t* card;
 
-esp_err_t storage_init (void) {
+/**
+ * Layout, everything is addressed by 512 byte sector.
+ *
+ * [superblock] [record|node] [record|node] ... [unused]
+ *
+ * A record is a descriptor sector followed by the block,
+ * nodes are B-tree index sectors. Two trees are kept, by block id
+ * and by blake2b hash, both keyed by 16 byte prefixes, lookups
+ * compare the full key against the descriptor so stale entries
+ * are harmless. Sector 0 is the superblock, so 0 doubles as null-pointer.
+ *
+ * Deleted records and replaced nodes become free extents, kept in
+ * one list per length. Allocation takes an extent of the same length,
+ * then grows into unused space, then splits a longer extent.
+ * When nothing fits the record under the hand is evicted,
+ * the hand walks the card in a circle so the oldest go first.
+ */
+#define SECTOR_SIZE STORE_SECTOR_SIZE
+#define SB_GLYPH 0b10110110
+#define DESC_GLYPH 0b10110111
+#define NODE_GLYPH 0b10111000
+#define FREE_GLYPH 0b10111001
+#define DESC_DELETED (1 << 0) /* legacy, deleted records are freed now */
+#define MAX_EXTENT (1 + STORE_MAX_DATA_SECTORS)
+#define DATA_SECTORS(size) (((size) + SECTOR_SIZE - 1) / SECTOR_SIZE)
+
+struct __attribute__((packed, aligned(4))) superblock {
+  uint8_t glyph;
+  uint8_t _reserved[3];
+  uint32_t n_sectors; /* device size at format */
+  uint32_t alloc; /* next free sector */
+  uint32_t id_root; /* B-tree by block id, 0: empty */
+  uint32_t hash_root; /* B-tree by hash, 0: empty */
+  uint32_t n_blocks; /* live records */
+  uint32_t free[MAX_EXTENT + 1]; /* free extents by length, 0: none */
+  uint32_t hand; /* next sector to evict from, 0: start */
+};
+
+struct __attribute__((packed)) free_extent {
+  uint8_t glyph; /* FREE_GLYPH */
+  uint8_t n; /* length in sectors */
+  uint32_t next; /* next free extent of same length, 0: none */
+};
+
+#define BT_KEY 16
+#define BT_DEGREE 10 /* t, nodes hold t-1 .. 2t-1 keys */
+#define BT_MAX (2 * BT_DEGREE - 1)
+#define BT_MAX_DEPTH 16 /* 10^16 keys, bounds sectors a single insert may allocate */
+#define BT_RESERVE (2 * BT_MAX_DEPTH + 1) /* two halves per split level + new root */
+
+struct __attribute__((packed)) bt_node {
+  uint8_t glyph; /* NODE_GLYPH */
+  uint8_t leaf;
+  uint16_t n;
+  uint8_t keys[BT_MAX][BT_KEY];
+  uint32_t records[BT_MAX];
+  uint32_t children[BT_MAX + 1];
+};
+_Static_assert(sizeof(struct bt_node) <= SECTOR_SIZE, "bt_node overflows sector");
+_Static_assert(sizeof(struct block_descriptor) <= SECTOR_SIZE, "descriptor overflows sector");
+
+static struct {
+  const store_device_t *device;
+  struct superblock sb;
+  SemaphoreHandle_t mutex;
+  store_evict_handler_t evict_handler;
+  /* sectors reserved for the nodes of the insert in progress */
+  uint32_t nodes[2 * BT_RESERVE];
+  int n_nodes;
+  int next_node;
+  /* nodes no tree points to anymore, freed on the next insert
+   * once the superblock that dropped them is written */
+  uint32_t garbage[4 * BT_RESERVE];
+  int n_garbage;
+} store = {0};
+
+#define STORE_LOCK() xSemaphoreTake(store.mutex, portMAX_DELAY)
+#define STORE_UNLOCK() xSemaphoreGive(store.mutex)
+
+/* Device I/O is always whole sectors, scratch is guarded by STORE_LOCK */
+static uint8_t scratch[SECTOR_SIZE];
+
+static esp_err_t read_sector(uint32_t sector, void *dst, size_t size) {
+  esp_err_t err = store.device->read(sector, scratch, 1);
+  memcpy(dst, scratch, size);
+  return err;
+}
+
+static esp_err_t write_sector(uint32_t sector, const void *src, size_t size) {
+  memset(scratch, 0, SECTOR_SIZE);
+  memcpy(scratch, src, size);
+  return store.device->write(sector, scratch, 1);
+}
+
+static void write_superblock(void) {
+  ESP_ERROR_CHECK(write_sector(0, &store.sb, sizeof(store.sb)));
+}
+
+/* Unused space past everything allocated so far, 0 when card is full */
+static uint32_t alloc_sectors(uint32_t n) {
+  if (store.sb.alloc + n > store.sb.n_sectors) return 0;
+  uint32_t sector = store.sb.alloc;
+  store.sb.alloc += n;
+  return sector;
+}
+
+/* Links extent into its free list, caller writes the superblock */
+static void free_extent(uint32_t sector, uint32_t n) {
+  struct free_extent ext = { .glyph = FREE_GLYPH, .n = n, .next = store.sb.free[n] };
+  ESP_ERROR_CHECK(write_sector(sector, &ext, sizeof(ext)));
+  store.sb.free[n] = sector;
+}
+
+static uint32_t take_free(uint32_t n) {
+  uint32_t sector = store.sb.free[n];
+  if (!sector) return 0;
+  struct free_extent ext;
+  ESP_ERROR_CHECK(read_sector(sector, &ext, sizeof(ext)));
+  if (ext.glyph != FREE_GLYPH || ext.n != n || ext.next >= store.sb.alloc) {
+    /* torn by a crash, drop the list, only leaks sectors */
+    ESP_LOGW(TAG, "Free list %"PRIu32" broken at sector %"PRIu32, n, sector);
+    store.sb.free[n] = 0;
+    return 0;
+  }
+  store.sb.free[n] = ext.next;
+  return sector;
+}
+
+/* Extent of n sectors or 0 when none is left */
+static uint32_t alloc_extent(uint32_t n) {
+  uint32_t sector = take_free(n);
+  if (!sector) sector = alloc_sectors(n);
+  for (uint32_t m = n + 1; !sector && m <= MAX_EXTENT; m++) {
+    sector = take_free(m);
+    if (sector) free_extent(sector + n, m - n);
+  }
+  return sector;
+}
+
+/* Sectors taken by whatever starts at sector, 1 for nodes & leaked sectors */
+static uint32_t extent_length(const uint8_t *buffer, int *live) {
+  const struct block_descriptor *desc = (const struct block_descriptor*)buffer;
+  const struct free_extent *ext = (const struct free_extent*)buffer;
+  *live = 0;
+  if (desc->glyph == DESC_GLYPH && desc->size <= STORE_MAX_BLOCK_SIZE) {
+    *live = !(desc->flags & DESC_DELETED);
+    return 1 + DATA_SECTORS(desc->size);
+  }
+  if (ext->glyph == FREE_GLYPH && ext->n >= 1 && ext->n <= MAX_EXTENT) return ext->n;
+  return 1;
+}
+
+/**
+ * Frees the next record from the hand on,
+ * index entries pointing to it turn stale.
+ * @return 0 or -1 after a full circle without one
+ */
+static int evict_next(void) {
+  static uint8_t buffer[SECTOR_SIZE];
+  const struct block_descriptor *desc = (const struct block_descriptor*)buffer;
+  for (uint32_t walked = 0; walked < store.sb.alloc;) {
+    if (store.sb.hand < 1 || store.sb.hand >= store.sb.alloc) store.sb.hand = 1;
+    const uint32_t sector = store.sb.hand;
+    ESP_ERROR_CHECK(store.device->read(sector, buffer, 1));
+    int live;
+    const uint32_t n = extent_length(buffer, &live);
+    store.sb.hand += n;
+    walked += n;
+    if (desc->glyph != DESC_GLYPH) continue;
+    if (live) { /* else legacy deleted, reclaimed on the way */
+      ESP_LOGI(TAG, "evicting record %"PRIu32, sector);
+      if (store.evict_handler != NULL) store.evict_handler(desc->hash);
+      store.sb.n_blocks--;
+    }
+    free_extent(sector, n);
+    return 0;
+  }
+  return -1;
+}
+
+/* Node sector reserved by append_record() */
+static uint32_t take_node(void) {
+  assert(store.next_node < store.n_nodes);
+  return store.nodes[store.next_node++];
+}
+
+static void drop_node(uint32_t sector) {
+  assert(store.n_garbage < (int)(sizeof(store.garbage) / sizeof(store.garbage[0])));
+  store.garbage[store.n_garbage++] = sector;
+}
+
+static void free_garbage(void) {
+  while (store.n_garbage) free_extent(store.garbage[--store.n_garbage], 1);
+}
+
+/* Descriptor of live record or -1 */
+static int load_descriptor(uint32_t record, struct block_descriptor *desc) {
+  if (record == 0 || record >= store.sb.alloc) return -1;
+  ESP_ERROR_CHECK(read_sector(record, desc, sizeof(*desc)));
+  if (desc->glyph != DESC_GLYPH || desc->flags & DESC_DELETED) return -1;
+  return 0;
+}
+
+static int match_id(uint32_t record, const uint8_t *id) {
+  struct block_descriptor desc;
+  return 0 == load_descriptor(record, &desc) && 0 == memcmp(desc.id, id, sizeof(block_id_t));
+}
+
+static int match_hash(uint32_t record, const uint8_t *hash) {
+  struct block_descriptor desc;
+  return 0 == load_descriptor(record, &desc) && 0 == memcmp(desc.hash, hash, sizeof(block_hash_t));
+}
+
+/**
+ * B-tree, insert splits full nodes on the way down
+ * so every insert is a single pass from the root.
+ * Splits are copy-on-write, both halves go to new sectors
+ * and the rewrite of the parent commits them, or the superblock
+ * when the root grows. A crash in between leaves the full node
+ * referenced, everything else is a single sector rewritten in place.
+ * Keys are not removed with their records, a full leaf drops
+ * its stale keys before it is split.
+ */
+static uint32_t bt_find(uint32_t root, const uint8_t *key, int (*match)(uint32_t, const uint8_t*), const uint8_t *full) {
+  struct bt_node node;
+  uint32_t sector = root;
+  while (sector) {
+    ESP_ERROR_CHECK(read_sector(sector, &node, sizeof(node)));
+    if (node.glyph != NODE_GLYPH) return 0; /* corrupt */
+    int i = 0;
+    while (i < node.n && memcmp(key, node.keys[i], BT_KEY) > 0) i++;
+    if (i < node.n && 0 == memcmp(key, node.keys[i], BT_KEY)) {
+      return match(node.records[i], full) ? node.records[i] : 0;
+    }
+    if (node.leaf) return 0;
+    sector = node.children[i];
+  }
+  return 0;
+}
+
+/* Nodes are static in here & bt_insert(), guarded by STORE_LOCK,
+ * keeps the stacks of writing tasks small */
+static void bt_split_child(uint32_t x_sector, struct bt_node *x, int i) {
+  static struct bt_node y, z;
+  memset(&z, 0, sizeof(z));
+  z.glyph = NODE_GLYPH;
+  ESP_ERROR_CHECK(read_sector(x->children[i], &y, sizeof(y)));
+  drop_node(x->children[i]);
+  uint32_t y_sector = take_node();
+  uint32_t z_sector = take_node();
+  z.leaf = y.leaf;
+  z.n = BT_DEGREE - 1;
+  memcpy(z.keys, y.keys[BT_DEGREE], z.n * BT_KEY);
+  memcpy(z.records, &y.records[BT_DEGREE], z.n * sizeof(uint32_t));
+  if (!y.leaf) memcpy(z.children, &y.children[BT_DEGREE], BT_DEGREE * sizeof(uint32_t));
+  y.n = BT_DEGREE - 1;
+
+  memmove(&x->children[i + 2], &x->children[i + 1], (x->n - i) * sizeof(uint32_t));
+  memmove(x->keys[i + 1], x->keys[i], (x->n - i) * BT_KEY);
+  memmove(&x->records[i + 1], &x->records[i], (x->n - i) * sizeof(uint32_t));
+  x->children[i] = y_sector;
+  x->children[i + 1] = z_sector;
+  memcpy(x->keys[i], y.keys[BT_DEGREE - 1], BT_KEY);
+  x->records[i] = y.records[BT_DEGREE - 1];
+  x->n++;
+  ESP_ERROR_CHECK(write_sector(z_sector, &z, sizeof(z)));
+  ESP_ERROR_CHECK(write_sector(y_sector, &y, sizeof(y)));
+  ESP_ERROR_CHECK(write_sector(x_sector, x, sizeof(*x)));
+}
+
+/* Drops keys of records that are gone, 1 when leaf was rewritten */
+static int bt_purge(uint32_t sector, struct bt_node *leaf, size_t key_at) {
+  struct block_descriptor desc;
+  int n = 0;
+  for (int i = 0; i < leaf->n; i++) {
+    if (0 != load_descriptor(leaf->records[i], &desc)) continue;
+    if (0 != memcmp((const uint8_t*)&desc + key_at, leaf->keys[i], BT_KEY)) continue;
+    memmove(leaf->keys[n], leaf->keys[i], BT_KEY);
+    leaf->records[n++] = leaf->records[i];
+  }
+  if (n == leaf->n) return 0;
+  leaf->n = n;
+  ESP_ERROR_CHECK(write_sector(sector, leaf, sizeof(*leaf)));
+  return 1;
+}
+
+/* Upper bound of nodes bt_insert() takes, one per full node on the path & new root */
+static int bt_insert_cost(uint32_t root, const uint8_t *key) {
+  static struct bt_node node;
+  if (root == 0) return 1;
+  int cost = 0;
+  uint32_t sector = root;
+  for (int depth = 0; sector && depth < BT_MAX_DEPTH; depth++) {
+    ESP_ERROR_CHECK(read_sector(sector, &node, sizeof(node)));
+    if (node.glyph != NODE_GLYPH) break;
+    if (node.n == BT_MAX) cost += sector == root ? 3 : 2;
+    int i = 0;
+    while (i < node.n && memcmp(key, node.keys[i], BT_KEY) > 0) i++;
+    if (node.leaf || (i < node.n && 0 == memcmp(key, node.keys[i], BT_KEY))) break;
+    sector = node.children[i];
+  }
+  return cost;
+}
+
+/**
+ * Inserts or replaces key, caller reserves bt_insert_cost() nodes
+ * and writes the superblock when *root changed.
+ * @param key_at offset of key in block_descriptor, for purges
+ */
+static void bt_insert(uint32_t *root, size_t key_at, const uint8_t *key, uint32_t record) {
+  static struct bt_node x, child;
+  if (*root == 0) {
+    memset(&x, 0, sizeof(x));
+    x.glyph = NODE_GLYPH;
+    x.leaf = 1;
+    x.n = 1;
+    memcpy(x.keys[0], key, BT_KEY);
+    x.records[0] = record;
+    *root = take_node();
+    ESP_ERROR_CHECK(write_sector(*root, &x, sizeof(x)));
+    return;
+  }
+  uint32_t sector = *root;
+  ESP_ERROR_CHECK(read_sector(sector, &x, sizeof(x)));
+  if (x.n == BT_MAX && !(x.leaf && bt_purge(sector, &x, key_at))) { /* grow in height */
+    memset(&x, 0, sizeof(x));
+    x.glyph = NODE_GLYPH;
+    x.children[0] = *root;
+    sector = take_node();
+    bt_split_child(sector, &x, 0);
+    *root = sector;
+  }
+  while (1) {
+    int i = 0;
+    while (i < x.n && memcmp(key, x.keys[i], BT_KEY) > 0) i++;
+    if (i < x.n && 0 == memcmp(key, x.keys[i], BT_KEY)) { /* stale or reused key */
+      x.records[i] = record;
+      ESP_ERROR_CHECK(write_sector(sector, &x, sizeof(x)));
+      return;
+    }
+    if (x.leaf) {
+      memmove(x.keys[i + 1], x.keys[i], (x.n - i) * BT_KEY);
+      memmove(&x.records[i + 1], &x.records[i], (x.n - i) * sizeof(uint32_t));
+      memcpy(x.keys[i], key, BT_KEY);
+      x.records[i] = record;
+      x.n++;
+      ESP_ERROR_CHECK(write_sector(sector, &x, sizeof(x)));
+      return;
+    }
+    ESP_ERROR_CHECK(read_sector(x.children[i], &child, sizeof(child)));
+    if (child.n == BT_MAX && !(child.leaf && bt_purge(x.children[i], &child, key_at))) {
+      bt_split_child(sector, &x, i);
+      int cmp = memcmp(key, x.keys[i], BT_KEY);
+      if (cmp == 0) {
+        x.records[i] = record;
+        ESP_ERROR_CHECK(write_sector(sector, &x, sizeof(x)));
+        return;
+      }
+      if (cmp > 0) i++;
+      ESP_ERROR_CHECK(read_sector(x.children[i], &child, sizeof(child)));
+    }
+    sector = x.children[i];
+    x = child;
+  }
+}
+
+int store_find_by_id(const uint8_t *id) {
+  STORE_LOCK();
+  uint32_t record = bt_find(store.sb.id_root, id, match_id, id);
+  STORE_UNLOCK();
+  return record ? (int)record : -1;
+}
+
+int store_find_by_hash(const uint8_t *hash) {
+  STORE_LOCK();
+  uint32_t record = bt_find(store.sb.hash_root, hash, match_hash, hash);
+  STORE_UNLOCK();
+  return record ? (int)record : -1;
+}
+
+/* Descriptor of block, hash & shares are left to the caller */
+static int describe_block(struct block_descriptor *desc, const uint8_t *block_bytes, uint8_t hops) {
+  const pf_block_t *block = (const pf_block_t*)block_bytes;
+  if (CANONICAL != pf_typeof(block)) return PR_ERROR_UNSUPPORTED_BLOCK_TYPE;
+  const size_t block_size = pf_sizeof(block);
+  if (block_size > STORE_MAX_BLOCK_SIZE) return PR_ERROR_BLOCK_TOO_LARGE;
+  memset(desc, 0, sizeof(*desc));
+  desc->glyph = DESC_GLYPH;
+  desc->size = block_size;
+  desc->date = pf_read_utc(block->net.date);
+  desc->date_recv = time(NULL);
+  desc->hops = hops;
+  memcpy(desc->author, block->net.author, sizeof(desc->author));
+  memcpy(desc->id, block->net.id, sizeof(desc->id));
+  return 0;
+}
+
+/* Extent for record & the nodes its insert takes, 0 when they don't fit */
+static uint32_t reserve_sectors(uint32_t n, int n_nodes) {
+  uint32_t record = alloc_extent(n);
+  int i = 0;
+  while (record && i < n_nodes && (store.nodes[i] = alloc_extent(1))) i++;
+  if (record && i == n_nodes) {
+    store.n_nodes = n_nodes;
+    store.next_node = 0;
+    return record;
+  }
+  while (i--) free_extent(store.nodes[i], 1);
+  if (record) free_extent(record, n);
+  return 0;
+}
+
+/* Writes record and indexes it, caller holds STORE_LOCK */
+static int append_record(const struct block_descriptor *desc, const uint8_t *block_bytes) {
+  if (bt_find(store.sb.id_root, desc->id, match_id, desc->id)) return PR_ERROR_DUPLICATE;
+  const uint32_t n = 1 + DATA_SECTORS(desc->size);
+  /* nodes replaced by the previous insert, its superblock is written */
+  free_garbage();
+  const int n_nodes = bt_insert_cost(store.sb.hash_root, desc->hash) + bt_insert_cost(store.sb.id_root, desc->id);
+  uint32_t record;
+  while (!(record = reserve_sectors(n, n_nodes))) {
+    if (0 != evict_next()) {
+      write_superblock();
+      return PR_ERROR_NO_SPACE;
+    }
+  }
+  /* Reserve record and nodes first, parents commit
+   * new nodes before the superblock does. A crash only leaks sectors */
+  write_superblock();
+  uint8_t *buffer = calloc(n, SECTOR_SIZE);
+  memcpy(buffer, desc, sizeof(*desc));
+  memcpy(buffer + SECTOR_SIZE, block_bytes, desc->size);
+  ESP_ERROR_CHECK(store.device->write(record, buffer, n));
+  free(buffer);
+  /* By hash first, a record torn in between is not known by id
+   * and rewriting it replaces the stale hash entry */
+  bt_insert(&store.sb.hash_root, offsetof(struct block_descriptor, hash), desc->hash, record);
+  bt_insert(&store.sb.id_root, offsetof(struct block_descriptor, id), desc->id, record);
+  /* left over when a purge saved a split */
+  while (store.next_node < store.n_nodes) drop_node(store.nodes[store.next_node++]);
+  store.n_nodes = 0;
+  store.next_node = 0;
+  store.sb.n_blocks++;
+  write_superblock();
+  ESP_LOGI(TAG, "write_block() size: %u => record %"PRIu32, desc->size, record);
+  return record;
+}
+
+int store_write_block(const uint8_t *block_bytes, uint8_t hops) {
+  struct block_descriptor desc;
+  int err = describe_block(&desc, block_bytes, hops);
+  if (err) return err;
+  crypto_blake2b(desc.hash, sizeof(desc.hash), block_bytes, desc.size);
+
+  STORE_LOCK();
+  int known = 0 != bt_find(store.sb.id_root, desc.id, match_id, desc.id);
+  STORE_UNLOCK();
+  if (known) return PR_ERROR_DUPLICATE;
+  const pf_block_t *block = (const pf_block_t*)block_bytes;
+  if (0 != pf_verify_block(block, block->net.author)) return PR_ERROR_INVALID_BLOCK;
+
+  STORE_LOCK();
+  int record = append_record(&desc, block_bytes);
+  STORE_UNLOCK();
+  return record;
+}
+
+int store_import_block(const uint8_t *block_bytes, const store_meta_t *meta) {
+  struct block_descriptor desc;
+  int err = describe_block(&desc, block_bytes, meta->hops);
+  if (err) return err;
+  desc.shares = meta->shares;
+  memcpy(desc.hash, meta->hash, sizeof(desc.hash));
+  STORE_LOCK();
+  int record = append_record(&desc, block_bytes);
+  STORE_UNLOCK();
+  return record;
+}
+
+int store_read_block(int record, uint8_t *dst, size_t max, store_meta_t *meta) {
+  struct block_descriptor desc;
+  STORE_LOCK();
+  int err = load_descriptor(record, &desc);
+  if (!err && dst != NULL) {
+    /* whole sectors straight into dst, the tail through scratch */
+    const size_t size = desc.size < max ? desc.size : max;
+    const size_t n_full = size / SECTOR_SIZE;
+    if (n_full) ESP_ERROR_CHECK(store.device->read(record + 1, dst, n_full));
+    if (size % SECTOR_SIZE) {
+      ESP_ERROR_CHECK(read_sector(record + 1 + n_full, dst + n_full * SECTOR_SIZE, size % SECTOR_SIZE));
+    }
+  }
+  STORE_UNLOCK();
+  if (err) return -1;
+  if (meta != NULL) {
+    meta->hops = desc.hops;
+    meta->shares = desc.shares;
+    meta->date = desc.date;
+    memcpy(meta->hash, desc.hash, sizeof(meta->hash));
+  }
+  return desc.size;
+}
+
+/* Record becomes a free extent, index entries to it turn stale */
+int store_delete_block(int record) {
+  struct block_descriptor desc;
+  STORE_LOCK();
+  int err = load_descriptor(record, &desc);
+  if (!err) {
+    free_extent(record, 1 + DATA_SECTORS(desc.size));
+    store.sb.n_blocks--;
+    write_superblock();
+  }
+  STORE_UNLOCK();
+  return err;
+}
+
+/* Descriptors are rewritten in place, sd-cards do their own wear-leveling */
+int store_decay(int record, const uint8_t *hash, int n) {
+  struct block_descriptor desc;
+  STORE_LOCK();
+  int shares = -1;
+  if (0 == load_descriptor(record, &desc) && 0 == memcmp(desc.hash, hash, sizeof(desc.hash))) {
+    shares = desc.shares + n > UINT8_MAX ? UINT8_MAX : desc.shares + n;
+    desc.shares = shares;
+    ESP_ERROR_CHECK(write_sector(record, &desc, sizeof(desc)));
+  }
+  STORE_UNLOCK();
+  return shares;
+}
+
+int store_iter_next(uint32_t *cursor) {
+  uint8_t buffer[SECTOR_SIZE];
+  STORE_LOCK();
+  if (*cursor == 0) *cursor = 1;
+  int record = 0;
+  while (!record && *cursor < store.sb.alloc) {
+    uint32_t sector = *cursor;
+    ESP_ERROR_CHECK(store.device->read(sector, buffer, 1));
+    int live;
+    *cursor += extent_length(buffer, &live);
+    if (live) record = sector;
+  }
+  STORE_UNLOCK();
+  return record;
+}
+
+int store_list_blocks(void) {
+  return store.sb.n_blocks;
+}
+
+void store_set_evict_handler(store_evict_handler_t handler) {
+  store.evict_handler = handler;
+}
+
+#if CONFIG_IDF_TARGET_LINUX
+/* Host: sectors in a plain file, created zeroed */
+static int image_fd = -1;
+
+static int file_open(uint32_t *n_sectors) {
+  const char *path = getenv("STORE_HOST_IMAGE");
+  if (path == NULL) path = "sd0.img";
+  image_fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (image_fd < 0) {
+    ESP_LOGE(TAG, "Could not open image '%s'", path);
+    return -1;
+  }
+  off_t size = lseek(image_fd, 0, SEEK_END);
+  if (size == 0) {
+    size = (off_t)STORE_HOST_SECTORS * SECTOR_SIZE;
+    if (ftruncate(image_fd, size)) {
+      ESP_LOGE(TAG, "Could not size image '%s'", path);
+      close(image_fd);
+      image_fd = -1;
+      return -1;
+    }
+  }
+  *n_sectors = size / SECTOR_SIZE;
+  return 0;
+}
+
+static void file_close(void) {
+  close(image_fd);
+  image_fd = -1;
+}
+
+static esp_err_t file_read(uint32_t sector, void *dst, size_t count) {
+  ssize_t n = pread(image_fd, dst, count * SECTOR_SIZE, (off_t)sector * SECTOR_SIZE);
+  return n == (ssize_t)(count * SECTOR_SIZE) ? ESP_OK : ESP_FAIL;
+}
+
+static esp_err_t file_write(uint32_t sector, const void *src, size_t count) {
+  ssize_t n = pwrite(image_fd, src, count * SECTOR_SIZE, (off_t)sector * SECTOR_SIZE);
+  return n == (ssize_t)(count * SECTOR_SIZE) ? ESP_OK : ESP_FAIL;
+}
+
+const store_device_t store_device_file = {
+  .name = "file",
+  .open = file_open,
+  .close = file_close,
+  .read = file_read,
+  .write = file_write
+};
+#else
+static sdmmc_host_t host = SDSPI_HOST_DEFAULT();
+static sdmmc_card_t card;
+
+static int sdspi_open(uint32_t *n_sectors) {
   esp_err_t ret;
   ESP_LOGI(TAG, "Using SPI peripheral");
 
@@ -35,7 +651,7 @@ esp_err_t storage_init (void) {
   ret = spi_bus_initialize(host.slot, &bus_cfg, SDSPI_DEFAULT_DMA);
   if (ret != ESP_OK) {
     ESP_LOGE(TAG, "Failed to initialize bus.");
-    return ret;
+    return -1;
   }
 
   // This initializes the slot without card detect (CD) and write protect (WP) signals.
@@ -45,68 +661,79 @@ esp_err_t storage_init (void) {
   slot_config.host_id = host.slot;
 
   ESP_LOGI(TAG, "Initializing SD card");
-  esp_vfs_fat_sdmmc_mount_config_t mount_config = {
-    .format_if_mount_failed = false,
-    .max_files = 5,
-    .allocation_unit_size = 16 * 1024
-  };
-
-  ESP_LOGI(TAG, "Mounting filesystem");
-  ret = esp_vfs_fat_sdspi_mount(mount_point, &host, &slot_config, &mount_config, &card);
-
+  sdspi_dev_handle_t handle;
+  ESP_ERROR_CHECK(sdspi_host_init());
+  ret = sdspi_host_init_device(&slot_config, &handle);
+  if (ret == ESP_OK) {
+    host.slot = handle;
+    ret = sdmmc_card_init(&host, &card);
+  }
   if (ret != ESP_OK) {
-    if (ret == ESP_FAIL) {
-      ESP_LOGE(TAG, "Failed to mount filesystem. "
-          "If you want the card to be formatted, set the CONFIG_EXAMPLE_FORMAT_IF_MOUNT_FAILED menuconfig option.");
-    } else {
-      ESP_LOGE(TAG, "Failed to initialize the card (%s). "
-          "Make sure SD card lines have pull-up resistors in place.", esp_err_to_name(ret));
-    }
-    return ret;
+    ESP_LOGE(TAG, "Failed to initialize the card (%s). "
+        "Make sure SD card lines have pull-up resistors in place.", esp_err_to_name(ret));
+    sdspi_host_deinit();
+    spi_bus_free(slot_config.host_id);
+    return -1;
   }
-  ESP_LOGI(TAG, "Filesystem mounted");
-
   // Card has been initialized, print its properties
-  sdmmc_card_print_info(stdout, card);
-  //sdmmc_write_sectors(card, &buffer, start_sector, sector_count); // Each sector is 512byte; 1k pBlock = 2sectors.
-
-  // Dummy test listing files
-  ESP_LOGI(TAG, "Listing root, for fun");
-  DIR *d;
-  struct dirent *entry;
-  d = opendir(MOUNT_POINT);
-  if (!d) {
-    ESP_LOGE(TAG, "Failed opening dir "MOUNT_POINT);
-    return 0;
-  }
-  while ((entry = readdir(d)) != NULL) {
-    ESP_LOGI(TAG, "%s\t [%c]", entry->d_name, entry->d_type);
-  }
-  closedir(d);
-  return ESP_OK;
+  sdmmc_card_print_info(stdout, &card);
+  *n_sectors = card.csd.capacity; /* Each sector is 512byte; 1k pBlock = 2sectors. */
+  return 0;
 }
 
-esp_err_t storage_deinit(void) {
-  esp_err_t res = esp_vfs_fat_sdcard_unmount(mount_point, card);
-  if (res != ESP_OK) ESP_LOGE(TAG, "Failed to Unmount %s", mount_point);
-  else ESP_LOGI(TAG, "sdcard %s unmounted", mount_point);
-  return spi_bus_free(host.slot);
+static void sdspi_close(void) {
+  sdspi_host_deinit();
+  spi_bus_free(SDSPI_DEFAULT_HOST);
 }
 
-#define SECTOR_SIZE 512
-#define SLOT_SIZE SECTOR_SIZE*4
-#define SLOT_ACTIVE 1
+static esp_err_t sdspi_read(uint32_t sector, void *dst, size_t count) {
+  return sdmmc_read_sectors(&card, dst, sector, count);
+}
 
-uint32_t next_empty(const uint32_t scan_start) {
-  uint8_t buffer[SECTOR_SIZE];
-  struct block_descriptor *hdr = (void*) &buffer;
-  uint32_t offset = scan_start;
-  while (1) {
-    esp_err_t ret = sdmmc_read_sectors(card, &buffer, offset, 1);
-    ESP_ERROR_CHECK(ret);
-    if (!(hdr->flags & 1)) break;
-    offset += SLOT_SIZE;
+static esp_err_t sdspi_write(uint32_t sector, const void *src, size_t count) {
+  return sdmmc_write_sectors(&card, src, sector, count);
+}
+
+const store_device_t store_device_sdspi = {
+  .name = "sdspi",
+  .open = sdspi_open,
+  .close = sdspi_close,
+  .read = sdspi_read,
+  .write = sdspi_write
+};
+#endif
+
+esp_err_t storage_init(const store_device_t *device) {
+#if CONFIG_IDF_TARGET_LINUX
+  if (device == NULL) device = &store_device_file;
+#else
+  if (device == NULL) device = &store_device_sdspi;
+#endif
+  if (store.mutex == NULL) store.mutex = xSemaphoreCreateMutex();
+  uint32_t n_sectors = 0;
+  if (0 != device->open(&n_sectors)) return ESP_FAIL;
+  store.device = device;
+  ESP_ERROR_CHECK(read_sector(0, &store.sb, sizeof(store.sb)));
+  if (store.sb.glyph != SB_GLYPH || store.sb.n_sectors > n_sectors) {
+    ESP_LOGW(TAG, "No superblock on %s, formatting %"PRIu32" sectors", device->name, n_sectors);
+    memset(&store.sb, 0, sizeof(store.sb));
+    store.sb.glyph = SB_GLYPH;
+    store.sb.n_sectors = n_sectors;
+    store.sb.alloc = 1;
+    write_superblock();
   }
-  return offset;
+  ESP_LOGI(TAG, "Store ready, %"PRIu32" blocks, %"PRIu32"/%"PRIu32" sectors used",
+    store.sb.n_blocks, store.sb.alloc, store.sb.n_sectors);
+  return ESP_OK;
 }
 
+esp_err_t storage_deinit(void) {
+  if (store.device == NULL) return ESP_OK;
+  STORE_LOCK();
+  free_garbage();
+  write_superblock();
+  STORE_UNLOCK();
+  store.device->close();
+  store.device = NULL;
+  return ESP_OK;
+}
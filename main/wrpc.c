@@ -2,6 +2,7 @@
 #include <esp_http_server.h>
 #include <esp_event.h>
 #include <esp_log.h>
+#include <unistd.h>
 #include "freertos/semphr.h"
 #include "freertos/timers.h"
 #include "esp_websocket_client.h"
@@ -17,28 +18,39 @@
 static const char *TAG_S = "wrpc.c:HOST";
 static const char *TAG_C = "wrpc.c:GUEST";
 static pwire_handlers_t handlers = {0};
-static SemaphoreHandle_t connection_mutex; /* Single peered for 4 now */
-// static SemaphoreHandle_t active; // = xSemaphoreCreateCounting(3, 0);
+#define WRPC_MAX_PEERS 3 /* SoftAP stations + our own client */
+static SemaphoreHandle_t connection_mutex; /* guards n_peers & informing */
+static int n_peers = 0;
+static int informing = 0; /* moved to INFORM by connection_lock() */
 //
 /*************** client/WS ************************/
 #define NO_DATA_TIMEOUT_SEC 5
 #define LOGE_NZ(msg, err) if (err != 0) ESP_LOGE(TAG_C, "Last error %s: 0x%x", msg, err)
 static SemaphoreHandle_t client_shutdown;
 static TimerHandle_t shutdown_timer;
+static void *client_session = NULL; /* one client at a time */
 
+/* First peer in moves to INFORM, last one out completes it.
+ * Only when we moved, completing from any other state would abort */
 static int connection_lock(const char* TAG) {
-  if (xSemaphoreTake(connection_mutex, pdMS_TO_TICKS(1000))) {
+  int err = 0;
+  xSemaphoreTake(connection_mutex, portMAX_DELAY);
+  if (n_peers == WRPC_MAX_PEERS) err = ESP_FAIL;
+  else if (n_peers++ == 0 && 0 == snail_transition_valid(INFORM)) {
     snail_transition(INFORM);
-    return 0;
-  } else {
-    ESP_LOGW(TAG, "Lock Failed");
-    return ESP_FAIL;
+    informing = 1;
   }
+  xSemaphoreGive(connection_mutex);
+  if (err) ESP_LOGW(TAG, "Lock Failed, %i peers", WRPC_MAX_PEERS);
+  return err;
 }
 
 static void connection_unlock(void) {
+  xSemaphoreTake(connection_mutex, portMAX_DELAY);
+  const int complete = --n_peers == 0 && informing;
+  if (complete) informing = 0;
   xSemaphoreGive(connection_mutex);
-  snail_inform_complete(0);
+  if (complete) snail_inform_complete(0);
 }
 
 static void kill_client(TimerHandle_t t) {
@@ -60,8 +72,13 @@ static void cframe_handler(void *args, esp_event_base_t base, int32_t event_id,
   switch(event_id) {
     case WEBSOCKET_EVENT_CONNECTED:
       ESP_LOGI(TAG_C, "connection established");
-      pwire_event_t event = { .initiator = true, .message = NULL, .size = 0 };
+      pwire_event_t event = { .initiator = true, .message = NULL, .size = 0, .session = NULL };
       pwire_ret_t reply = handlers.on_open(&event);
+      client_session = event.session;
+      if (reply == PW_CLOSE) {
+	kill_client(NULL);
+	break;
+      }
       /* Initiators must initiate on open */
       assert(reply == PW_REPLY);
       assert(event.message != NULL);
@@ -88,17 +105,20 @@ static void cframe_handler(void *args, esp_event_base_t base, int32_t event_id,
 	  data->op_code);
       if (data->op_code == 8) return; /* 8 means clean close? */
       xTimerReset(shutdown_timer, portMAX_DELAY);
-      pwire_event_t event = { .initiator = true, .message = NULL, .size = 0 };
+      pwire_event_t event = { .initiator = true, .message = NULL, .size = 0, .session = client_session };
       event.size = data->payload_len;
       event.message = (uint8_t *)(data->data_ptr + data->payload_offset);
       pwire_ret_t reply = handlers.on_data(&event);
-      if (reply == PW_REPLY) {
+      /* Pipelined frames are pulled until the handler runs dry */
+      while (reply == PW_REPLY || reply == PW_REPLY_MORE) {
 	assert(event.message != NULL);
 	assert(event.size != 0);
 	esp_websocket_client_send_bin(client, (const char*) event.message, event.size, portMAX_DELAY);
-      } else {
-	kill_client(NULL);
+	if (reply == PW_REPLY) break;
+	event = (pwire_event_t){ .initiator = true, .message = NULL, .size = 0, .session = client_session };
+	reply = handlers.on_data(&event);
       }
+      if (reply == PW_CLOSE) kill_client(NULL);
     } break;
     case WEBSOCKET_EVENT_ERROR:
       ESP_LOGI(TAG_C, "WEBSOCKET_EVENT_ERROR");
@@ -133,12 +153,14 @@ esp_err_t wrpc_connect(esp_netif_t *interface, ip_addr_t *target_address) {
     .disable_auto_reconnect = 1,
     .transport = WEBSOCKET_TRANSPORT_OVER_TCP,
     .reconnect_timeout_ms = 10000,
-    .network_timeout_ms = 10000
+    .network_timeout_ms = 10000,
+    .buffer_size = PW_MAX_FRAME_SIZE /* whole frames per event, on_data can't reassemble */
   };
 
   esp_websocket_client_handle_t client = esp_websocket_client_init(&config);
   if (client == NULL) {
     ESP_LOGE(TAG_C, "client initialization failed");
+    connection_unlock();
     return -1;
   }
 
@@ -156,8 +178,9 @@ esp_err_t wrpc_connect(esp_netif_t *interface, ip_addr_t *target_address) {
   ESP_LOGI(TAG_C, "Websocket Stopped");
   esp_websocket_client_close(client, pdMS_TO_TICKS(2000));
   esp_websocket_client_destroy(client);
-  pwire_event_t event = { .initiator = true, .message = NULL, .size = 0 };
+  pwire_event_t event = { .initiator = true, .message = NULL, .size = 0, .session = client_session };
   handlers.on_close(&event);
+  client_session = NULL;
   connection_unlock();
   return ESP_OK;
 }
@@ -179,7 +202,7 @@ static esp_err_t frame_handler(httpd_req_t *req) {
         return err;
     }
 
-    if (ws_pkt.len == 0 || ws_pkt.len > 4096) {
+    if (ws_pkt.len == 0 || ws_pkt.len > PW_MAX_FRAME_SIZE) {
       ESP_LOGE(TAG_S, "invalid frame length: %zu", ws_pkt.len);
       return ESP_ERR_NO_MEM;
     } else ESP_LOGI(TAG_S, "got data with len: %zu", ws_pkt.len);
@@ -201,25 +224,28 @@ static esp_err_t frame_handler(httpd_req_t *req) {
       .initiator = 0,
       .message = buf,
       .size = ws_pkt.len,
+      .session = req->sess_ctx
     };
     pwire_ret_t rep = handlers.on_data(&event);
-    if (rep == PW_REPLY) {
+    /* Pipelined frames are pulled until the handler runs dry */
+    while (rep == PW_REPLY || rep == PW_REPLY_MORE) {
       assert(event.message != NULL);
       assert(event.size != 0);
       ws_pkt.payload = event.message;
       ws_pkt.len = event.size;
       err = httpd_ws_send_frame(req, &ws_pkt);
-      free(buf);
       if (err != ESP_OK) {
 	ESP_LOGE(TAG_S, "httpd_ws_send_frame failed with %d", err);
+	free(buf);
 	return -1;
       }
-    } else {
-      free(buf);
-      return 1; // Signal connection close;
+      if (rep == PW_REPLY) break;
+      event = (pwire_event_t){ .initiator = 0, .message = NULL, .size = 0, .session = req->sess_ctx };
+      rep = handlers.on_data(&event);
     }
-
-    return err;
+    free(buf);
+    if (rep == PW_CLOSE) return 1; // Signal connection close;
+    return ESP_OK;
 }
 
 static const httpd_uri_t ws = {
@@ -230,19 +256,31 @@ static const httpd_uri_t ws = {
         .is_websocket = true
 };
 
+/* Sessions live in the socket's context, httpd frees nothing of it */
+static void keep_session(void *ctx) {}
+
 esp_err_t httpd_onconnect(httpd_handle_t hd, int sockfd) {
   ESP_LOGI(TAG_S, "httpd connected %i", sockfd);
   if (0 != connection_lock(TAG_S)) return ESP_FAIL;
-  pwire_event_t ev = { .initiator = false, .size = 0, .message = NULL };
-  handlers.on_open(&ev);
-  return ESP_OK; // -1 to fast disconnect
+  pwire_event_t ev = { .initiator = false, .size = 0, .message = NULL, .session = NULL };
+  if (PW_CLOSE == handlers.on_open(&ev)) {
+    connection_unlock();
+    return ESP_FAIL; // fast disconnect
+  }
+  httpd_sess_set_ctx(hd, sockfd, ev.session, keep_session);
+  return ESP_OK;
 }
 
+/* Also runs when httpd_onconnect() refused, then without session */
 void httpd_onclose(httpd_handle_t hd, int sockfd) {
   ESP_LOGI(TAG_S, "httpd disconnected %i", sockfd);
-  pwire_event_t ev = { .initiator = false, .size = 0, .message = NULL };
-  handlers.on_close(&ev);
-  connection_unlock();
+  pwire_event_t ev = { .initiator = false, .size = 0, .message = NULL, .session = httpd_sess_get_ctx(hd, sockfd) };
+  if (ev.session != NULL) {
+    handlers.on_close(&ev);
+    httpd_sess_set_ctx(hd, sockfd, NULL, keep_session);
+    connection_unlock();
+  }
+  close(sockfd); /* ours to close when close_fn is set */
 }
 
 esp_err_t wrpc_init(pwire_handlers_t *message_handlers) {